@@ -15,34 +15,139 @@
 //    - That it appears at the end of the name
 //
 // To compile, use any of:
-//    make nwnltr
-//    cc -o nwnltr nwnltr.c
+//    make nwnltr LDLIBS="-pthread -lm"
+//    cc -pthread -o nwnltr nwnltr.c -lm
 //
 #include "stdio.h"
+#include "stddef.h"
 #include "stdint.h"
 #include "stdlib.h"
 #include "stdarg.h"
 #include "string.h"
 #include "ctype.h"
+#include "math.h"
 #include "time.h"
+#include "pthread.h"
+#include "fcntl.h"
+#include "unistd.h"
+#include "dirent.h"
+#include "sys/mman.h"
+#include "sys/stat.h"
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include "immintrin.h"
+#define HAVE_X86_KERNELS
+#endif
 
 #define HELP \
 "NWN name generator tool\n" \
-"Usage: nwnltr [OPTION] <LTRFILE>\n" \
+"Usage: nwnltr [OPTION] [INPUT]... <LTRFILE>\n" \
 "Options:\n" \
 " -p, --print         Print Markov chain tables for <LTRFILE> in a human readable format\n" \
-" -b, --build         Build Markov chain tables using words from stdin and store in <LTRFILE>\n" \
+" -b, --build         Build Markov chain tables using words from stdin and store in <LTRFILE>.\n" \
+"                     The n-gram counts are kept in <LTRFILE> (v2) or in <LTRFILE>.cnt (v1)\n" \
+" -u, --update        Add the words from stdin to the counts of <LTRFILE> and rewrite it\n" \
+"                     -b and -u read the words from any files given before <LTRFILE> instead\n" \
+"                     of stdin, split over the -j threads\n" \
+"     --tagged        With -b, read \"tag<TAB>words\" lines and build <LTRFILE>/tag.ltr for\n" \
+"                     every tag at once. <LTRFILE> is a directory then\n" \
+"     --blend         Mix all <LTRFILE>s given as FILE:WEIGHT into one table, e.g.\n" \
+"                     --blend elfm.ltr:0.5 humanm.ltr:0.5 -o halfelfm.ltr\n" \
+"     --smooth=MODE   Give every state the generator can reach middle and end letters, from\n" \
+"                     the pairs and singles (backoff) or by adding K to every count (addk[:K],\n" \
+"                     K=1 by default). Applied when building, so -u needs it again, and\n" \
+"                     refuses tables marked smoothed (in v2 files and .cnt sidecars) without it\n" \
+" -o, --output=FILE   Write the tables of <LTRFILE> to FILE, to convert formats. Applies fixing,\n" \
+"                     --smooth and --prune first. Only v2 files keep --force-end\n" \
+"     --emit-header=FILE\n" \
+"                     Write the tables of <LTRFILE>, as for -o, to FILE as a C/C++ header of\n" \
+"                     alias tables, with an inline generator that gives the names of -c -a\n" \
+"     --pack          Pack the <LTRFILE>s, or all .ltr files of the directories given, into the\n" \
+"                     bundle given with -o, e.g. --pack extra/ltr/ -o names.ltrb. Tables are\n" \
+"                     page aligned, in --format (v2 by default). Any option taking an <LTRFILE>\n" \
+"                     reads a table of a bundle as BUNDLE:NAME, e.g. names.ltrb:elfm\n" \
+"     --format=FMT    Format of written files: v1 (game compatible, default) or v2 (sparse,\n" \
+"                     checksummed, with n-gram counts and a custom alphabet). -u keeps the\n" \
+"                     format of <LTRFILE> by default\n" \
+"     --alphabet=STR  Letters to build tables for. Only v2 files support other than the default\n" \
 " -g, --generate=NUM  Generate NUM names from <LTRFILE> and print to stdout. NUM=100 by default\n" \
 " -s, --seed=NUM      Set the RNG seed to NUM. time(NULL) by default\n" \
-" -n, --nofix         Do not fix corrupted tables in ltr files (if detected). default is to fix\n"
+"     --min-len=NUM   Only generate names of at least NUM letters\n" \
+"     --max-len=NUM   Only generate names of at most NUM letters\n" \
+"     --prefix=STR    Only generate names starting with STR\n" \
+"     --suffix=STR    Only generate names ending with STR\n" \
+"     --enumerate=K   Print the K names -g is most likely to give, with their probabilities.\n" \
+"                     These count the ways to a name through backtracks and restarts, but not\n" \
+"                     the rare abort after 100 backtracks\n" \
+"     --enum-mem=MB   Memory the --enumerate search may use. 256 by default\n" \
+"     --score         Print every line of stdin (or of the files given before <LTRFILE>) with\n" \
+"                     the log probability of generating it, on -j threads\n" \
+"     --classify      Print every line of stdin with the <LTRFILE>s most likely to generate it\n" \
+"                     and their log probabilities, e.g. --classify extra/ltr/*.ltr\n" \
+"     --top=M         Number of tables --classify prints per name. 3 by default\n" \
+" -n, --nofix         Do not fix corrupted tables in ltr files (if detected). default is to fix\n" \
+"     --prune         Remove transitions that can never lead to a complete name, and report\n" \
+"                     how many restarts and backtracks that saves. States without middle\n" \
+"                     letters still back off, which only --force-end stops\n" \
+"     --force-end     End a name in a state without middle letters even if the end test\n" \
+"                     failed, instead of backing off. Changes the length distribution\n" \
+" -a, --alias         Sample from precomputed alias tables instead of scanning the CDFs\n" \
+"     --sparse        Keep only the non-zero thresholds, packed per row, and sample from those\n" \
+"     --quantize=BITS Sample from 16 or 32 bit integer thresholds instead of the float ones, and\n" \
+"                     print the error against them. 32 bit gives the same names on any platform\n" \
+"     --relayout      Keep the middle and end rows of every state together, 64 byte aligned,\n" \
+"                     and the start rows apart, so that a step reads fewer cache lines\n" \
+" -j, --threads=NUM   Generate names on NUM threads. Output only depends on the seed and NUM\n" \
+" -c, --counter       Use a counter based RNG: name number I only depends on the seed and I\n" \
+"     --index=NUM     With -c, start generating at name number NUM. 0 by default\n" \
+"     --lanes=NUM     Generate NUM (8 or 16) names at a time in lockstep SIMD lanes. Implies -c,\n" \
+"                     and gives the same names. Ignored for constrained names\n" \
+"     --kernel=NAME   CDF scan and Philox kernel: scalar, sse2 or avx2. Best supported by default\n" \
+"     --bench         Benchmark the CDF scan kernels on every <LTRFILE> given, on the\n" \
+"                     --quantize tables if given\n" \
+"     --stats         Print phase timings and sampler counters to stderr as JSON\n"
 
+enum { SMOOTH_NONE, SMOOTH_BACKOFF, SMOOTH_ADDK };
 struct cfg {
     int   build;
+    int   update;
+    int   tagged;
+    int   blend;
+    int   pack;
+    int   smooth;
+    int   min_len;
+    int   max_len;
+    char *prefix;
+    char *suffix;
+    int   enumerate;
+    int   score;
+    int   classify;
+    int   top;
+    int   enum_mem;
+    double smooth_k;
+    int   format;
+    char *output;
+    char *emit_header;
+    char *alphabet;
     int   print;
     int   nofix;
+    int   prune;
+    int   force_end;
+    int   alias;
+    int   sparse;
+    int   quantize;
+    int   relayout;
     int   generate;
     int   seed;
+    int   threads;
+    int   counter;
+    int   lanes;
+    unsigned long long index;
+    int   bench;
+    int   stats;
+    char *kernel;
     char *ltrfile;
+    char **files;
+    int   num_files;
 } cfg;
 
 #define die(format, ...)                                \
@@ -58,24 +163,117 @@ void parse_cmdline(int argc, char *argv[]) {
         exit(0);
     }
 
-    for (int i = 1; i < argc - 1; i++) {
-        cfg.print |= !strcmp(argv[i], "-p") || !strcmp(argv[i], "--print");
-        cfg.build |= !strcmp(argv[i], "-b") || !strcmp(argv[i], "--build");
-        cfg.nofix |= !strcmp(argv[i], "-n") || !strcmp(argv[i], "--nofix");
+    cfg.files = calloc(argc, sizeof(char *));
+    for (int i = 1; i < argc; i++) {
+        if (argv[i][0] != '-') {
+            cfg.files[cfg.num_files++] = argv[i];
+            continue;
+        }
+
+        cfg.print   |= !strcmp(argv[i], "-p") || !strcmp(argv[i], "--print");
+        cfg.build   |= !strcmp(argv[i], "-b") || !strcmp(argv[i], "--build");
+        cfg.update  |= !strcmp(argv[i], "-u") || !strcmp(argv[i], "--update");
+        cfg.tagged  |= !strcmp(argv[i], "--tagged");
+        cfg.blend   |= !strcmp(argv[i], "--blend");
+        cfg.pack    |= !strcmp(argv[i], "--pack");
+        cfg.score   |= !strcmp(argv[i], "--score");
+        cfg.classify |= !strcmp(argv[i], "--classify");
+        sscanf(argv[i], "--top=%d", &cfg.top);
+        cfg.nofix   |= !strcmp(argv[i], "-n") || !strcmp(argv[i], "--nofix");
+        cfg.alias   |= !strcmp(argv[i], "-a") || !strcmp(argv[i], "--alias");
+        cfg.counter |= !strcmp(argv[i], "-c") || !strcmp(argv[i], "--counter");
+        cfg.bench   |= !strcmp(argv[i], "--bench");
+        cfg.prune   |= !strcmp(argv[i], "--prune");
+        cfg.force_end |= !strcmp(argv[i], "--force-end");
+        cfg.stats   |= !strcmp(argv[i], "--stats");
+        cfg.sparse  |= !strcmp(argv[i], "--sparse");
+        cfg.relayout |= !strcmp(argv[i], "--relayout");
+
+        sscanf(argv[i], "--index=%llu", &cfg.index);
+        sscanf(argv[i], "--lanes=%d", &cfg.lanes);
+        sscanf(argv[i], "--quantize=%d", &cfg.quantize);
+        sscanf(argv[i], "--enumerate=%d", &cfg.enumerate);
+        sscanf(argv[i], "--enum-mem=%d", &cfg.enum_mem);
+        sscanf(argv[i], "--min-len=%d", &cfg.min_len);
+        sscanf(argv[i], "--max-len=%d", &cfg.max_len);
+        if (!strncmp(argv[i], "--prefix=", 9))
+            cfg.prefix = argv[i] + 9;
+        if (!strncmp(argv[i], "--suffix=", 9))
+            cfg.suffix = argv[i] + 9;
+        if (!strcmp(argv[i], "--smooth=backoff"))
+            cfg.smooth = SMOOTH_BACKOFF;
+        else if (!strcmp(argv[i], "--smooth=addk") && (cfg.smooth_k = 1.0))
+            cfg.smooth = SMOOTH_ADDK;
+        else if (sscanf(argv[i], "--smooth=addk:%lf", &cfg.smooth_k) == 1 && cfg.smooth_k > 0.0)
+            cfg.smooth = SMOOTH_ADDK;
+        else if (!strncmp(argv[i], "--smooth=", 9))
+            die("Unknown smoothing %s", argv[i] + 9);
+        if (!strncmp(argv[i], "--alphabet=", 11))
+            cfg.alphabet = argv[i] + 11;
+        if (!strcmp(argv[i], "--format=v1") || !strcmp(argv[i], "--format=v2"))
+            cfg.format = argv[i][10] - '0';
+        else if (!strncmp(argv[i], "--format=", 9))
+            die("Unknown format %s", argv[i] + 9);
+
+        if (!strcmp(argv[i], "-o") && i + 1 < argc)
+            cfg.output = argv[++i];
+        else if (!strncmp(argv[i], "--output=", 9))
+            cfg.output = argv[i] + 9;
+
+        if (!strncmp(argv[i], "--emit-header=", 14))
+            cfg.emit_header = argv[i] + 14;
+
+        if (!strncmp(argv[i], "--kernel=", 9))
+            cfg.kernel = argv[i] + 9;
 
-        sscanf(argv[i], "--seed=%d", &cfg.seed) || (!strcmp(argv[i], "-s") && sscanf(argv[i+1], "%d", &cfg.seed));
+        if (!strcmp(argv[i], "-s") && i + 1 < argc)
+            sscanf(argv[++i], "%d", &cfg.seed);
+        else
+            sscanf(argv[i], "--seed=%d", &cfg.seed);
+
+        if (!strcmp(argv[i], "-j") && i + 1 < argc)
+            sscanf(argv[++i], "%d", &cfg.threads);
+        else
+            sscanf(argv[i], "--threads=%d", &cfg.threads);
 
         if (sscanf(argv[i], "--generate=%d", &cfg.generate) != 1) {
             if (!strcmp(argv[i], "--generate"))
                 cfg.generate = 100;
             else if (!strcmp(argv[i], "-g"))
-                sscanf(argv[i+1], "%d", &cfg.generate) == 1 ? i++ : (cfg.generate = 100);
+                i + 1 < argc && sscanf(argv[i+1], "%d", &cfg.generate) == 1 ? i++ : (cfg.generate = 100);
         }
     }
 
-    cfg.ltrfile = argv[argc-1];
-    if (!(cfg.print || cfg.build || cfg.generate)) {
-        printf("Need at least one of -p, -b, -g\n" HELP);
+    if (cfg.num_files == 0) {
+        printf("Need an <LTRFILE>\n" HELP);
+        exit(0);
+    }
+    cfg.ltrfile = cfg.files[cfg.num_files - 1];
+    if (cfg.threads < 1)
+        cfg.threads = 1;
+    if (cfg.lanes && cfg.lanes != 8 && cfg.lanes != 16)
+        die("--lanes must be 8 or 16");
+    if (cfg.quantize && cfg.quantize != 16 && cfg.quantize != 32)
+        die("--quantize must be 16 or 32");
+    if (cfg.quantize && cfg.sparse)
+        die("Use only one of --quantize and --sparse");
+    if (cfg.relayout && cfg.sparse)
+        die("Use only one of --relayout and --sparse");
+    if (cfg.build + cfg.update + cfg.blend > 1)
+        die("Use only one of -b, -u and --blend");
+    if (cfg.tagged && !cfg.build)
+        die("--tagged only works with -b");
+    if (cfg.pack && !cfg.output)
+        die("--pack needs the bundle to write, with -o");
+    if (cfg.update && strchr(cfg.ltrfile, ':') && access(cfg.ltrfile, F_OK))
+        die("Can't update %s, tables in bundles are read only", cfg.ltrfile);
+    if (cfg.top <= 0)
+        cfg.top = 3;
+    if (cfg.enum_mem <= 0)
+        cfg.enum_mem = 256;
+    if (!(cfg.print || cfg.build || cfg.update || cfg.generate || cfg.bench || cfg.output || cfg.enumerate > 0 ||
+          cfg.score || cfg.classify || cfg.emit_header)) {
+        printf("Need at least one of -p, -b, -u, -g, -o, --emit-header, --enumerate, --score, --classify, --bench\n" HELP);
         exit(0);
     }
 }
@@ -88,15 +286,22 @@ void parse_cmdline(int argc, char *argv[]) {
 #ifndef NUM_LETTERS
 #define NUM_LETTERS 28
 #endif
+#if NUM_LETTERS > 64 // lane masks of the vector kernels are 64 bit
+#undef HAVE_X86_KERNELS
+#endif
 static const char letters[] = "abcdefghijklmnopqrstuvwxyz'-";
+// The thresholds follow the 9 byte header in the file, and mapped files are
+// used in place, so they can't be assumed to be more than byte aligned. This
+// makes the in memory layout of struct ltrfile exactly the file layout.
+typedef float ltrfloat __attribute__((aligned(1)));
 struct ltr_header {
     char     magic[8];
     uint8_t  num_letters;
 };
 struct cdf {
-    float start  [NUM_LETTERS];
-    float middle [NUM_LETTERS];
-    float end    [NUM_LETTERS];
+    ltrfloat start  [NUM_LETTERS];
+    ltrfloat middle [NUM_LETTERS];
+    ltrfloat end    [NUM_LETTERS];
 };
 struct ltrdata {
     struct cdf singles;
@@ -108,29 +313,794 @@ struct ltrfile {
     struct ltrdata data;
 };
 
-static float nrand() { return (float)rand() / RAND_MAX; }
-static int idx(char letter) {
-    if (letter == '\'') return 26;
-    if (letter == '-')  return 27;
-    if (letter >= 'a' && letter <= 'z') return letter - 'a';
-    return -1;
+// struct ltrdata viewed as a flat array of NUM_ROWS CDF rows, NUM_LETTERS each.
+// Row numbers are 3 * <index of the struct cdf> + <start|middle|end>
+#define NUM_CDFS (1 + NUM_LETTERS + NUM_LETTERS * NUM_LETTERS)
+#define NUM_ROWS (3 * NUM_CDFS)
+enum { ROW_START, ROW_MIDDLE, ROW_END };
+#define SINGLE_ROW(kind)       (kind)
+#define DOUBLE_ROW(a, kind)    (3 * (1 + (a)) + (kind))
+#define TRIPLE_ROW(a, b, kind) (3 * (1 + NUM_LETTERS + (a) * NUM_LETTERS + (b)) + (kind))
+_Static_assert(sizeof(struct ltrdata) == NUM_ROWS * NUM_LETTERS * sizeof(float), "struct ltrdata is not packed");
+_Static_assert(sizeof(struct ltrfile) == 9 + sizeof(struct ltrdata), "struct ltrfile does not match the file layout");
+
+static const ltrfloat *ltr_row(const struct ltrdata *data, int row) {
+    return (const ltrfloat *)data + row * NUM_LETTERS;
 }
 
-void load_ltr(const char *filename, struct ltrfile *ltr) {
-    FILE *f = fopen(filename, "rb");
-    if (!f)
-        die("Unable to open file %s", filename);
+// Draws of the RNG are 31 bit, from 0 to RNG_MAX (see next_rng())
+#define RNG_MAX 0x7fffffff
+
+// CDF scan kernels: return the first letter whose threshold is above prob, or
+// NUM_LETTERS if there is none. Since prob is never negative, zero thresholds
+// never match, which is what makes letters with a probability of 0 skipped.
+// The vector kernels compare all the lanes at once and pick the lowest set bit
+// of the mask, which is exactly the letter the scalar loop stops at.
+static int scan_scalar(const ltrfloat *row, float prob) {
+    int i;
+    for (i = 0; i < NUM_LETTERS; i++)
+        if (prob < row[i])
+            break;
+    return i;
+}
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("sse2")))
+static int scan_sse2(const ltrfloat *row, float prob) {
+    const __m128 p = _mm_set1_ps(prob);
+    uint64_t mask = 0;
+    int i = 0;
+    for (; i + 4 <= NUM_LETTERS; i += 4)
+        mask |= (uint64_t)_mm_movemask_ps(_mm_cmplt_ps(p, _mm_loadu_ps((const float *)(row + i)))) << i;
+#if NUM_LETTERS % 4
+    for (; i < NUM_LETTERS; i++)
+        mask |= (uint64_t)(prob < row[i]) << i;
+#endif
+    return mask ? __builtin_ctzll(mask) : NUM_LETTERS;
+}
+
+__attribute__((target("avx2")))
+static int scan_avx2(const ltrfloat *row, float prob) {
+    const __m256 p = _mm256_set1_ps(prob);
+    uint64_t mask = 0;
+    int i = 0;
+    for (; i + 8 <= NUM_LETTERS; i += 8)
+        mask |= (uint64_t)_mm256_movemask_ps(_mm256_cmp_ps(p, _mm256_loadu_ps((const float *)(row + i)), _CMP_LT_OQ)) << i;
+    for (; i + 4 <= NUM_LETTERS; i += 4)
+        mask |= (uint64_t)_mm_movemask_ps(_mm_cmplt_ps(_mm256_castps256_ps128(p), _mm_loadu_ps((const float *)(row + i)))) << i;
+#if NUM_LETTERS % 4
+    for (; i < NUM_LETTERS; i++)
+        mask |= (uint64_t)(prob < row[i]) << i;
+#endif
+    return mask ? __builtin_ctzll(mask) : NUM_LETTERS;
+}
+#endif
+
+// The same scans over quantized rows (see struct quant_data), taking the raw
+// draw r instead of a float. Cells and draws are both offset by 2^(bits-1),
+// so the signed compares of the vector units order them as unsigned.
+static int scan_q16_scalar(const int16_t *row, int r) {
+    const int x = (r >> 15) - 32768;
+    int i;
+    for (i = 0; i < NUM_LETTERS; i++)
+        if (x < row[i])
+            break;
+    return i;
+}
+
+static int scan_q32_scalar(const int32_t *row, int r) {
+    const int32_t x = r + INT32_MIN;
+    int i;
+    for (i = 0; i < NUM_LETTERS; i++)
+        if (x < row[i])
+            break;
+    return i;
+}
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("sse2")))
+static int scan_q16_sse2(const int16_t *row, int r) {
+    const __m128i x = _mm_set1_epi16((r >> 15) - 32768);
+    uint64_t mask = 0;
+    int i = 0;
+    for (; i + 16 <= NUM_LETTERS; i += 16) {
+        const __m128i lo = _mm_cmplt_epi16(x, _mm_loadu_si128((const __m128i *)(row + i)));
+        const __m128i hi = _mm_cmplt_epi16(x, _mm_loadu_si128((const __m128i *)(row + i + 8)));
+        mask |= (uint64_t)_mm_movemask_epi8(_mm_packs_epi16(lo, hi)) << i;
+    }
+    for (; i + 8 <= NUM_LETTERS; i += 8) {
+        const __m128i lt = _mm_cmplt_epi16(x, _mm_loadu_si128((const __m128i *)(row + i)));
+        mask |= (uint64_t)(_mm_movemask_epi8(_mm_packs_epi16(lt, lt)) & 0xff) << i;
+    }
+#if NUM_LETTERS % 8
+    for (; i < NUM_LETTERS; i++)
+        mask |= (uint64_t)((r >> 15) - 32768 < row[i]) << i;
+#endif
+    return mask ? __builtin_ctzll(mask) : NUM_LETTERS;
+}
+
+__attribute__((target("sse2")))
+static int scan_q32_sse2(const int32_t *row, int r) {
+    const __m128i x = _mm_set1_epi32(r + INT32_MIN);
+    uint64_t mask = 0;
+    int i = 0;
+    for (; i + 4 <= NUM_LETTERS; i += 4)
+        mask |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmplt_epi32(x, _mm_loadu_si128((const __m128i *)(row + i))))) << i;
+#if NUM_LETTERS % 4
+    for (; i < NUM_LETTERS; i++)
+        mask |= (uint64_t)(r + INT32_MIN < row[i]) << i;
+#endif
+    return mask ? __builtin_ctzll(mask) : NUM_LETTERS;
+}
+
+__attribute__((target("avx2")))
+static int scan_q16_avx2(const int16_t *row, int r) {
+    const __m256i x = _mm256_set1_epi16((r >> 15) - 32768);
+    uint64_t mask = 0;
+    int i = 0;
+    for (; i + 16 <= NUM_LETTERS; i += 16) {
+        const __m256i lt = _mm256_cmpgt_epi16(_mm256_loadu_si256((const __m256i *)(row + i)), x);
+        mask |= (uint64_t)_mm_movemask_epi8(_mm_packs_epi16(_mm256_castsi256_si128(lt), _mm256_extracti128_si256(lt, 1))) << i;
+    }
+    for (; i + 8 <= NUM_LETTERS; i += 8) {
+        const __m128i lt = _mm_cmplt_epi16(_mm256_castsi256_si128(x), _mm_loadu_si128((const __m128i *)(row + i)));
+        mask |= (uint64_t)(_mm_movemask_epi8(_mm_packs_epi16(lt, lt)) & 0xff) << i;
+    }
+#if NUM_LETTERS % 8
+    for (; i < NUM_LETTERS; i++)
+        mask |= (uint64_t)((r >> 15) - 32768 < row[i]) << i;
+#endif
+    return mask ? __builtin_ctzll(mask) : NUM_LETTERS;
+}
+
+__attribute__((target("avx2")))
+static int scan_q32_avx2(const int32_t *row, int r) {
+    const __m256i x = _mm256_set1_epi32(r + INT32_MIN);
+    uint64_t mask = 0;
+    int i = 0;
+    for (; i + 8 <= NUM_LETTERS; i += 8)
+        mask |= (uint64_t)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_loadu_si256((const __m256i *)(row + i)), x))) << i;
+    for (; i + 4 <= NUM_LETTERS; i += 4)
+        mask |= (uint64_t)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmplt_epi32(_mm256_castsi256_si128(x), _mm_loadu_si128((const __m128i *)(row + i))))) << i;
+#if NUM_LETTERS % 4
+    for (; i < NUM_LETTERS; i++)
+        mask |= (uint64_t)(r + INT32_MIN < row[i]) << i;
+#endif
+    return mask ? __builtin_ctzll(mask) : NUM_LETTERS;
+}
+#endif
+
+// Philox4x32-10, the block function of the counter based RNG (see struct rng)
+static void philox(const uint32_t key[2], const uint32_t ctr[4], uint32_t out[4]) {
+    uint32_t k0 = key[0], k1 = key[1];
+    uint32_t c0 = ctr[0], c1 = ctr[1], c2 = ctr[2], c3 = ctr[3];
+    for (int round = 0; round < 10; round++) {
+        uint64_t p0 = (uint64_t)0xD2511F53 * c0;
+        uint64_t p1 = (uint64_t)0xCD9E8D57 * c2;
+        c0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;
+        c2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;
+        c1 = (uint32_t)p1;
+        c3 = (uint32_t)p0;
+        k0 += 0x9E3779B9;
+        k1 += 0xBB67AE85;
+    }
+    out[0] = c0; out[1] = c1; out[2] = c2; out[3] = c3;
+}
+
+// Philox blocks for the lanes of the batch generator, lane l counting
+// (ctr[0][l], ctr[1][l], ctr[2][l], 0). num is a multiple of 8. The vector
+// kernels do the 32x32->64 bit multiplies of 4 or 8 lanes at once, the odd
+// lanes shifted down into the even ones, which are the ones mul_epu32 reads.
+#define MAX_LANES 16
+static void philox_lanes_scalar(const uint32_t key[2], uint32_t ctr[3][MAX_LANES], int num, uint32_t out[4][MAX_LANES]) {
+    for (int l = 0; l < num; l++) {
+        uint32_t c[4] = { ctr[0][l], ctr[1][l], ctr[2][l], 0 }, o[4];
+        philox(key, c, o);
+        for (int i = 0; i < 4; i++)
+            out[i][l] = o[i];
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+__attribute__((target("sse2")))
+static void philox_lanes_sse2(const uint32_t key[2], uint32_t ctr[3][MAX_LANES], int num, uint32_t out[4][MAX_LANES]) {
+    const __m128i m0 = _mm_set1_epi32(0xD2511F53), m1 = _mm_set1_epi32(0xCD9E8D57);
+    const __m128i lo = _mm_set1_epi64x(0xffffffff), hi = _mm_set1_epi64x(0xffffffff00000000);
+    for (int l = 0; l < num; l += 4) {
+        __m128i c0 = _mm_loadu_si128((const __m128i *)&ctr[0][l]);
+        __m128i c1 = _mm_loadu_si128((const __m128i *)&ctr[1][l]);
+        __m128i c2 = _mm_loadu_si128((const __m128i *)&ctr[2][l]);
+        __m128i c3 = _mm_setzero_si128();
+        uint32_t k0 = key[0], k1 = key[1];
+        for (int round = 0; round < 10; round++) {
+            __m128i e0 = _mm_mul_epu32(c0, m0), o0 = _mm_mul_epu32(_mm_srli_epi64(c0, 32), m0);
+            __m128i e1 = _mm_mul_epu32(c2, m1), o1 = _mm_mul_epu32(_mm_srli_epi64(c2, 32), m1);
+            __m128i hi1 = _mm_or_si128(_mm_srli_epi64(e1, 32), _mm_and_si128(o1, hi));
+            __m128i hi0 = _mm_or_si128(_mm_srli_epi64(e0, 32), _mm_and_si128(o0, hi));
+            c0 = _mm_xor_si128(_mm_xor_si128(hi1, c1), _mm_set1_epi32(k0));
+            c2 = _mm_xor_si128(_mm_xor_si128(hi0, c3), _mm_set1_epi32(k1));
+            c1 = _mm_or_si128(_mm_and_si128(e1, lo), _mm_slli_epi64(o1, 32));
+            c3 = _mm_or_si128(_mm_and_si128(e0, lo), _mm_slli_epi64(o0, 32));
+            k0 += 0x9E3779B9;
+            k1 += 0xBB67AE85;
+        }
+        _mm_storeu_si128((__m128i *)&out[0][l], c0);
+        _mm_storeu_si128((__m128i *)&out[1][l], c1);
+        _mm_storeu_si128((__m128i *)&out[2][l], c2);
+        _mm_storeu_si128((__m128i *)&out[3][l], c3);
+    }
+}
+
+// Philox blocks of groups of 8 lanes, the rounds of all groups interleaved so
+// their multiplies overlap
+__attribute__((target("avx2"), always_inline))
+static inline void philox8(const uint32_t key[2], const int groups, const __m256i *ctr0, const __m256i *ctr1,
+                           const __m256i *ctr2, __m256i (*out)[4]) {
+    const __m256i m0 = _mm256_set1_epi32(0xD2511F53), m1 = _mm256_set1_epi32(0xCD9E8D57);
+    __m256i c0[MAX_LANES / 8], c1[MAX_LANES / 8], c2[MAX_LANES / 8], c3[MAX_LANES / 8];
+    for (int g = 0; g < groups; g++) {
+        c0[g] = ctr0[g]; c1[g] = ctr1[g]; c2[g] = ctr2[g]; c3[g] = _mm256_setzero_si256();
+    }
+    uint32_t k0 = key[0], k1 = key[1];
+    for (int round = 0; round < 10; round++) {
+        for (int g = 0; g < groups; g++) {
+            __m256i e0 = _mm256_mul_epu32(c0[g], m0), o0 = _mm256_mul_epu32(_mm256_srli_epi64(c0[g], 32), m0);
+            __m256i e1 = _mm256_mul_epu32(c2[g], m1), o1 = _mm256_mul_epu32(_mm256_srli_epi64(c2[g], 32), m1);
+            __m256i hi1 = _mm256_blend_epi32(_mm256_srli_epi64(e1, 32), o1, 0xAA);
+            __m256i hi0 = _mm256_blend_epi32(_mm256_srli_epi64(e0, 32), o0, 0xAA);
+            c0[g] = _mm256_xor_si256(_mm256_xor_si256(hi1, c1[g]), _mm256_set1_epi32(k0));
+            c2[g] = _mm256_xor_si256(_mm256_xor_si256(hi0, c3[g]), _mm256_set1_epi32(k1));
+            c1[g] = _mm256_blend_epi32(e1, _mm256_slli_epi64(o1, 32), 0xAA);
+            c3[g] = _mm256_blend_epi32(e0, _mm256_slli_epi64(o0, 32), 0xAA);
+        }
+        k0 += 0x9E3779B9;
+        k1 += 0xBB67AE85;
+    }
+    for (int g = 0; g < groups; g++) {
+        out[g][0] = c0[g]; out[g][1] = c1[g]; out[g][2] = c2[g]; out[g][3] = c3[g];
+    }
+}
+
+__attribute__((target("avx2")))
+static void philox_lanes_avx2(const uint32_t key[2], uint32_t ctr[3][MAX_LANES], int num, uint32_t out[4][MAX_LANES]) {
+    for (int l = 0; l < num; l += 8) {
+        __m256i c0 = _mm256_loadu_si256((const __m256i *)&ctr[0][l]), c1 = _mm256_loadu_si256((const __m256i *)&ctr[1][l]);
+        __m256i c2 = _mm256_loadu_si256((const __m256i *)&ctr[2][l]), o[1][4];
+        philox8(key, 1, &c0, &c1, &c2, o);
+        for (int i = 0; i < 4; i++)
+            _mm256_storeu_si256((__m256i *)&out[i][l], o[0][i]);
+    }
+}
+#endif
+
+struct kernel {
+    const char *name;
+    int (*scan)(const ltrfloat *row, float prob);
+    int (*scan_q16)(const int16_t *row, int r);
+    int (*scan_q32)(const int32_t *row, int r);
+    void (*philox_lanes)(const uint32_t key[2], uint32_t ctr[3][MAX_LANES], int num, uint32_t out[4][MAX_LANES]);
+    int (*supported)(void);
+};
+static int always(void) { return 1; }
+#ifdef HAVE_X86_KERNELS
+static int has_sse2(void) { return __builtin_cpu_supports("sse2"); }
+static int has_avx2(void) { return __builtin_cpu_supports("avx2"); }
+#endif
+// Ordered from the slowest to the fastest
+static const struct kernel kernels[] = {
+    { "scalar", scan_scalar, scan_q16_scalar, scan_q32_scalar, philox_lanes_scalar, always   },
+#ifdef HAVE_X86_KERNELS
+    { "sse2",   scan_sse2,   scan_q16_sse2,   scan_q32_sse2,   philox_lanes_sse2,   has_sse2 },
+    { "avx2",   scan_avx2,   scan_q16_avx2,   scan_q32_avx2,   philox_lanes_avx2,   has_avx2 },
+#endif
+};
+#define NUM_KERNELS (int)(sizeof(kernels) / sizeof(kernels[0]))
+
+static int (*scan_row)(const ltrfloat *row, float prob) = scan_scalar;
+static int (*scan_q16_row)(const int16_t *row, int r) = scan_q16_scalar;
+static int (*scan_q32_row)(const int32_t *row, int r) = scan_q32_scalar;
+static void (*philox_lanes)(const uint32_t key[2], uint32_t ctr[3][MAX_LANES], int num, uint32_t out[4][MAX_LANES]) =
+    philox_lanes_scalar;
+
+void select_kernel(const char *name) {
+    for (int k = NUM_KERNELS - 1; k >= 0; k--) {
+        if (name ? !strcmp(name, kernels[k].name) : kernels[k].supported()) {
+            if (!kernels[k].supported())
+                die("Kernel %s is not supported on this CPU", name);
+            scan_row = kernels[k].scan;
+            scan_q16_row = kernels[k].scan_q16;
+            scan_q32_row = kernels[k].scan_q32;
+            philox_lanes = kernels[k].philox_lanes;
+            return;
+        }
+    }
+    die("Unknown kernel %s", name);
+}
+
+// Walker/Vose alias tables, one per non-empty CDF row.
+// Outcome NUM_LETTERS stands for "no letter", which is what a CDF scan yields
+// when the random number is past the last threshold. Keeping it as an outcome
+// means a draw follows exactly the same distribution as the scan it replaces.
+struct alias_row {
+    uint32_t cut[NUM_LETTERS + 1];   // P(keep column) scaled to 2^31
+    uint8_t  alias[NUM_LETTERS + 1];
+};
+struct alias_data {
+    int32_t rowidx[NUM_ROWS];        // -1 for rows that are all zero
+    int32_t num_rows;
+    struct alias_row rows[];
+};
+
+// CSR layout of the thresholds above zero, which are the only ones a scan can
+// ever stop at. Row r has cells rowptr[r] to rowptr[r+1]-1, in scan order.
+struct sparse_data {
+    uint32_t rowptr[NUM_ROWS + 1];
+    uint8_t *letter;
+    float   *cut;
+};
+
+// Integer thresholds, converted from the float rows at load time. Row r has
+// NUM_LETTERS cells at r * NUM_LETTERS, which are compared with the raw draws
+// (see pick()), stored minus 2^(bits-1):
+//  - 32 bit: the number of draws the float scan sends to a letter up to i, so
+//    draw < cell picks exactly the letter the float compare picks
+//  - 16 bit: the same rounded to 2^-16, against the top 16 bits of the draw
+struct quant_data {
+    int      bits;
+    int16_t *q16;
+    int32_t *q32;
+};
+
+// Hot/cold copy of the dense rows the sampler scans (the float ones, or the
+// quantized ones if any). Every step of a name reads the middle and end rows
+// of one CDF, so those two share a 64 byte aligned slot of hot, while the
+// start rows, read only at the start of a name, are packed apart in cold.
+struct layout_data {
+    size_t   row_bytes;
+    size_t   stride;    // bytes per slot of hot, a multiple of 64
+    uint8_t *hot;
+    uint8_t *cold;
+};
+
+// Raw n-gram counts the CDFs were built from, same shape as struct ltrdata
+struct cdfcounts {
+    uint64_t start  [NUM_LETTERS];
+    uint64_t middle [NUM_LETTERS];
+    uint64_t end    [NUM_LETTERS];
+};
+struct ltrcounts {
+    struct cdfcounts singles;
+    struct cdfcounts doubles[NUM_LETTERS];
+    struct cdfcounts triples[NUM_LETTERS][NUM_LETTERS];
+};
+
+static uint64_t *count_row(struct ltrcounts *counts, int row) {
+    return (uint64_t *)counts + row * NUM_LETTERS;
+}
+
+// A loaded table plus whatever was precomputed from it for sampling.
+// The tables are always NUM_LETTERS wide. Files with a smaller alphabet
+// leave the letters past num_letters at zero, so they are never picked.
+struct ltrmodel {
+    struct ltrfile     *ltr;
+    struct ltrcounts   *counts;    // NULL if the file has none
+    struct alias_data  *alias;     // NULL to scan the CDFs
+    struct sparse_data *sparse;    // NULL to scan the dense rows
+    struct quant_data  *quant;     // NULL to scan the float thresholds
+    struct layout_data *layout;    // NULL to scan the rows where they are
+    struct constraint  *constraint; // NULL for unconstrained names, see new_constraint()
+    size_t              mapped;    // size of the mapping if ltr is mapped
+    int                 format;    // 1 or 2, of the file it was loaded from
+    int                 force_end; // see random_name_r()
+    int                 smoothed;  // the CDFs are not those of the counts alone
+    int                 num_letters;
+    char                alphabet[NUM_LETTERS + 1];
+};
 
-    if (fread(&ltr->header, 9, 1, f) != 1 || strncmp(ltr->header.magic, "LTR V1.0", 8))
+
+static void check_header(const char *filename, const struct ltrfile *ltr) {
+    if (strncmp(ltr->header.magic, "LTR V1.0", 8))
         die("File %s has no valid LTR header", filename);
 
     if (ltr->header.num_letters != NUM_LETTERS)
         die("File built for %d letters, tool only supports %d.", ltr->header.num_letters, NUM_LETTERS);
+}
+
+// Returns the contents of a file. Regular files are mapped in place: the
+// mapping is private, so all processes mapping a file share its page cache
+// copy, and fix_ltr() or prune_ltr() writing to it only copy the pages they
+// touch. Anything else (e.g. a pipe) is read into memory.
+static uint8_t *read_file(const char *filename, size_t *size, int *mapped) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        die("Unable to open file %s", filename);
+
+    struct stat st;
+    if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+        uint8_t *buf = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (buf != MAP_FAILED) {
+            close(fd);
+            *size = st.st_size;
+            *mapped = 1;
+            return buf;
+        }
+    }
+
+    size_t cap = 1 << 16;
+    uint8_t *buf = malloc(cap);
+    ssize_t got;
+    *size = 0;
+    while (buf && (got = read(fd, buf + *size, cap - *size)) > 0) {
+        *size += got;
+        if (*size == cap)
+            buf = realloc(buf, cap *= 2);
+    }
+    if (!buf)
+        die("Unable to allocate memory for %s", filename);
+    close(fd);
+    *mapped = 0;
+    return buf;
+}
+
+// LTR V2.0 files, all little endian:
+//   struct ltr2_header
+//   uint8_t  cells per row, for all 3 * (1 + n + n*n) rows of the n letters,
+//            in the same order as in V1.0 files
+//   struct ltr2_cell for every threshold above zero, row by row
+//   uint64_t count for every cell, if the file has LTR2_COUNTS
+// Every section starts 8 byte aligned and has its own CRC-32 in the header.
+// LTR2_FORCE_END keeps --force-end, which is a property of the generator and
+// not of the thresholds. LTR2_SMOOTHED marks thresholds that were smoothed
+// after being built from the counts.
+#define LTR2_COUNTS    1
+#define LTR2_FORCE_END 2
+#define LTR2_SMOOTHED  4
+struct ltr2_header {
+    char     magic[8];
+    uint8_t  num_letters;
+    uint8_t  flags;
+    uint16_t reserved;
+    uint32_t num_cells;
+    char     alphabet[32];
+    uint32_t crc_index;
+    uint32_t crc_cells;
+    uint32_t crc_counts;
+    uint32_t crc_header; // of everything above
+};
+struct ltr2_cell {
+    float   cut;
+    uint8_t letter;
+    uint8_t reserved[3];
+};
+_Static_assert(sizeof(struct ltr2_header) == 64, "struct ltr2_header has padding");
+_Static_assert(NUM_LETTERS <= 32, "LTR V2.0 alphabets are at most 32 letters");
+
+static uint32_t crc32(const void *buf, size_t len) {
+    const uint8_t *p = buf;
+    uint32_t crc = ~0u;
+    while (len--) {
+        crc ^= *p++;
+        for (int k = 0; k < 8; k++)
+            crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+    return ~crc;
+}
+
+static size_t align8(size_t n) { return (n + 7) & ~(size_t)7; }
+
+// Row number of a V2.0 file with n letters, for a row of the in memory tables
+static int file_row(int row, int n) {
+    int cdf = row / 3, kind = row % 3;
+    if (cdf == 0)
+        return kind;
+    if (cdf <= NUM_LETTERS)
+        return cdf - 1 < n ? 3 * cdf + kind : -1;
+    int a = (cdf - 1 - NUM_LETTERS) / NUM_LETTERS, b = (cdf - 1 - NUM_LETTERS) % NUM_LETTERS;
+    return a < n && b < n ? 3 * (1 + n + a * n + b) + kind : -1;
+}
+
+// Returns what is wrong with the n letters of an alphabet, or NULL. Letters
+// must be distinct, and something count_name() can match: it lowercases the
+// input, stops at '#', and control characters and spaces are not names.
+static const char *alphabet_error(const char *alphabet, int n) {
+    if (n == 0)
+        return "has no letters";
+    if (n > NUM_LETTERS)
+        return "has too many letters";
+    for (int i = 0; i < n; i++) {
+        const uint8_t c = alphabet[i];
+        if (c == '\0' || iscntrl(c) || isspace(c) || c == '#')
+            return "has a control character, a space or '#'";
+        if (tolower(c) != c)
+            return "has an uppercase letter, but names are lowercased when counted";
+        if (memchr(alphabet, c, i))
+            return "has a letter twice";
+    }
+    return NULL;
+}
 
-    if (fread(&ltr->data, sizeof(ltr->data), 1, f) != 1)
+void load_ltr2(const char *filename, const uint8_t *buf, size_t size, struct ltrmodel *model) {
+    struct ltr2_header h;
+    if (size < sizeof(h))
+        die("File %s has no valid LTR header", filename);
+    memcpy(&h, buf, sizeof(h));
+    if (crc32(&h, offsetof(struct ltr2_header, crc_header)) != h.crc_header)
+        die("File %s has a corrupted LTR V2.0 header", filename);
+    if (h.num_letters == 0 || h.num_letters > NUM_LETTERS)
+        die("File built for %d letters, tool only supports up to %d.", h.num_letters, NUM_LETTERS);
+    const char *bad = alphabet_error(h.alphabet, h.num_letters);
+    if (bad)
+        die("File %s is corrupted: its alphabet %s", filename, bad);
+
+    const int n = h.num_letters;
+    const size_t num_rows = 3 * (1 + n + n * n);
+    const size_t index = sizeof(h), cells = align8(index + num_rows);
+    const size_t counts = align8(cells + (size_t)h.num_cells * sizeof(struct ltr2_cell));
+    const size_t end = counts + (h.flags & LTR2_COUNTS ? (size_t)h.num_cells * sizeof(uint64_t) : 0);
+    if (size < end)
         die("Unable to read the prob table from %s. Truncated file?", filename);
+    if (crc32(buf + index, num_rows) != h.crc_index ||
+        crc32(buf + cells, (size_t)h.num_cells * sizeof(struct ltr2_cell)) != h.crc_cells ||
+        ((h.flags & LTR2_COUNTS) && crc32(buf + counts, (size_t)h.num_cells * sizeof(uint64_t)) != h.crc_counts))
+        die("File %s is corrupted: checksum mismatch", filename);
+
+    if (!(model->ltr = calloc(1, sizeof(*model->ltr))))
+        die("Unable to allocate memory for %s", filename);
+    memcpy(model->ltr->header.magic, "LTR V1.0", 8);
+    model->ltr->header.num_letters = NUM_LETTERS;
+    if ((h.flags & LTR2_COUNTS) && !(model->counts = calloc(1, sizeof(*model->counts))))
+        die("Unable to allocate memory for %s", filename);
+
+    // Cell offset of every file row
+    uint32_t *first = malloc((num_rows + 1) * sizeof(*first));
+    if (!first)
+        die("Unable to allocate memory for %s", filename);
+    first[0] = 0;
+    for (size_t r = 0; r < num_rows; r++)
+        first[r + 1] = first[r] + buf[index + r];
+    if (first[num_rows] != h.num_cells)
+        die("File %s is corrupted: row index does not match the cell count", filename);
+
+    for (int row = 0; row < NUM_ROWS; row++) {
+        int fr = file_row(row, n);
+        if (fr < 0)
+            continue;
+        ltrfloat *dst = (ltrfloat *)ltr_row(&model->ltr->data, row);
+        int prev = -1;
+        for (uint32_t c = first[fr]; c < first[fr + 1]; c++) {
+            struct ltr2_cell cell;
+            memcpy(&cell, buf + cells + c * sizeof(cell), sizeof(cell));
+            if (cell.letter >= n || cell.letter <= prev)
+                die("File %s is corrupted: bad letter %d in row %d", filename, cell.letter, fr);
+            prev = cell.letter;
+            dst[cell.letter] = cell.cut;
+            if (model->counts)
+                memcpy(&count_row(model->counts, row)[cell.letter], buf + counts + c * sizeof(uint64_t), sizeof(uint64_t));
+        }
+    }
+    free(first);
 
-    fclose(f);
+    model->num_letters = n;
+    memcpy(model->alphabet, h.alphabet, n);
+    model->alphabet[n] = '\0';
+    model->force_end = !!(h.flags & LTR2_FORCE_END);
+    model->smoothed = !!(h.flags & LTR2_SMOOTHED);
+}
+
+// Name of the file holding the counts of a V1.0 file
+static char *count_file(const char *filename) {
+    char *name = malloc(strlen(filename) + 5);
+    if (!name)
+        die("Unable to allocate memory for %s", filename);
+    return strcat(strcpy(name, filename), ".cnt");
+}
+
+// Files are written next to their final name and renamed into place, so a
+// failed write never leaves a truncated table behind, and a table can be
+// written back over the (possibly mapped) file it was loaded from.
+static void finish_file(FILE *f, char *tmpname, const char *filename) {
+    if (fclose(f) || rename(tmpname, filename))
+        die("Unable to write file %s", filename);
+    free(tmpname);
+}
+
+// Writes a table as a V1.0 or V2.0 file at the current position of f. The
+// counts of V1.0 files are left to the caller.
+static void write_table(FILE *f, const char *filename, const struct ltrmodel *model, int format) {
+    const int n = model->num_letters;
+    if (format == 1) {
+        if (n > NUM_LETTERS || strncmp(model->alphabet, letters, n))
+            die("LTR V1.0 files only support the \"%s\" alphabet, use --format=v2", letters);
+        if (model->force_end)
+            fprintf(stderr, "Warning: LTR V1.0 files can't keep --force-end, %s needs it again to generate the same names\n", filename);
+        struct ltr_header header = { "LTR V1.0", NUM_LETTERS };
+        fwrite(&header, 9, 1, f);
+        fwrite(&model->ltr->data, sizeof(model->ltr->data), 1, f);
+        return;
+    }
+
+    const size_t num_rows = 3 * (1 + n + n * n);
+    uint8_t *index = calloc(num_rows, 1);
+    struct ltr2_cell *cells = calloc((size_t)num_rows * n, sizeof(*cells));
+    uint64_t *counts = calloc((size_t)num_rows * n, sizeof(*counts));
+    if (!index || !cells || !counts)
+        die("Unable to allocate memory for %s", filename);
+
+    struct ltr2_header h = { "LTR V2.0", n, (model->counts ? LTR2_COUNTS : 0) | (model->force_end ? LTR2_FORCE_END : 0) |
+                             (model->smoothed ? LTR2_SMOOTHED : 0), 0, 0, {0}, 0, 0, 0, 0 };
+    memcpy(h.alphabet, model->alphabet, n);
+    for (int row = 0; row < NUM_ROWS; row++) {
+        int fr = file_row(row, n);
+        if (fr < 0)
+            continue;
+        const ltrfloat *src = ltr_row(&model->ltr->data, row);
+        for (int i = 0; i < n; i++) {
+            if (src[i] > 0.0f) {
+                cells[h.num_cells].cut    = src[i];
+                cells[h.num_cells].letter = i;
+                if (model->counts)
+                    counts[h.num_cells] = count_row(model->counts, row)[i];
+                h.num_cells++;
+                index[fr]++;
+            }
+        }
+    }
+
+    static const uint8_t zero[8];
+    h.crc_index  = crc32(index, num_rows);
+    h.crc_cells  = crc32(cells, h.num_cells * sizeof(*cells));
+    h.crc_counts = model->counts ? crc32(counts, h.num_cells * sizeof(*counts)) : 0;
+    h.crc_header = crc32(&h, offsetof(struct ltr2_header, crc_header));
+    fwrite(&h, sizeof(h), 1, f);
+    fwrite(index, 1, num_rows, f);
+    fwrite(zero, 1, align8(sizeof(h) + num_rows) - (sizeof(h) + num_rows), f);
+    fwrite(cells, sizeof(*cells), h.num_cells, f);
+    if (model->counts)
+        fwrite(counts, sizeof(*counts), h.num_cells, f);
+    free(index); free(cells); free(counts);
+}
+
+void write_ltr(const char *filename, const struct ltrmodel *model, int format) {
+    char *tmpname = malloc(strlen(filename) + 5);
+    if (!tmpname)
+        die("Unable to allocate memory for %s", filename);
+    FILE *f = fopen(strcat(strcpy(tmpname, filename), ".tmp"), "wb");
+    if (!f) die("Unable to create file %s", filename);
+    write_table(f, filename, model, format);
+    finish_file(f, tmpname, filename);
+
+    if (format == 1 && model->counts) {
+        // No room for the counts in V1.0, so they go to a V2.0 sidecar
+        char *sidecar = count_file(filename);
+        write_ltr(sidecar, model, 2);
+        free(sidecar);
+    }
+}
+
+// LTR bundles (--pack), all little endian:
+//   struct ltrb_header
+//   struct ltrb_entry for every table, sorted by name
+//   the tables, each a V1.0 or V2.0 file as it would be written alone
+// Every table starts on a LTRB_PAGE boundary, so it can be mapped on its own,
+// and V1.0 tables are then used in place just like V1.0 files.
+#define LTRB_PAGE 4096
+struct ltrb_header {
+    char     magic[8];
+    uint32_t num_tables;
+    uint32_t page_size;
+    uint32_t crc_index;
+    uint32_t crc_header; // of everything above
+};
+struct ltrb_entry {
+    char     name[48];   // NUL padded
+    uint64_t offset;     // from the start of the bundle
+    uint64_t size;
+};
+_Static_assert(sizeof(struct ltrb_header) == 24, "struct ltrb_header has padding");
+_Static_assert(sizeof(struct ltrb_entry) == 64, "struct ltrb_entry has padding");
+
+// Reads the header and index of a bundle into *h and the returned array
+static struct ltrb_entry *read_bundle_index(int fd, const char *filename, struct ltrb_header *h) {
+    if (pread(fd, h, sizeof(*h), 0) != sizeof(*h) || memcmp(h->magic, "LTRB V1", 8))
+        die("File %s is not an LTR bundle", filename);
+    if (crc32(h, offsetof(struct ltrb_header, crc_header)) != h->crc_header)
+        die("File %s has a corrupted bundle header", filename);
+
+    const size_t bytes = (size_t)h->num_tables * sizeof(struct ltrb_entry);
+    struct ltrb_entry *index = malloc(bytes + 1);
+    if (!index)
+        die("Unable to allocate memory for %s", filename);
+    if (pread(fd, index, bytes, sizeof(*h)) != (ssize_t)bytes || crc32(index, bytes) != h->crc_index)
+        die("File %s is corrupted: bundle index checksum mismatch", filename);
+    return index;
+}
+
+// Returns the contents of table name of a bundle, like read_file(). Tables
+// on page boundaries are mapped straight from the bundle, so a process only
+// maps the table it uses, and all processes share the page cache copy.
+static uint8_t *read_bundle(const char *filename, const char *name, size_t *size, int *mapped) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        die("Unable to open file %s", filename);
+    struct stat st;
+    if (fstat(fd, &st))
+        die("Unable to open file %s", filename);
+
+    struct ltrb_header h;
+    struct ltrb_entry *index = read_bundle_index(fd, filename, &h), e;
+    uint32_t i;
+    for (i = 0; i < h.num_tables; i++)
+        if (!strncmp(index[i].name, name, sizeof(index[i].name)) && strlen(name) < sizeof(index[i].name))
+            break;
+    if (i == h.num_tables)
+        die("No table %s in bundle %s", name, filename);
+    e = index[i];
+    free(index);
+    if (e.size == 0 || e.offset > (uint64_t)st.st_size || e.size > (uint64_t)st.st_size - e.offset)
+        die("Unable to read table %s from %s. Truncated file?", name, filename);
+
+    uint8_t *buf;
+    *size = e.size;
+    if (e.offset % sysconf(_SC_PAGESIZE) == 0 &&
+        (buf = mmap(NULL, e.size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, e.offset)) != MAP_FAILED) {
+        *mapped = 1;
+    } else {
+        if (!(buf = malloc(e.size)))
+            die("Unable to allocate memory for %s", filename);
+        if (pread(fd, buf, e.size, e.offset) != (ssize_t)e.size)
+            die("Unable to read table %s from %s. Truncated file?", name, filename);
+        *mapped = 0;
+    }
+    close(fd);
+    return buf;
+}
+
+// Opens a V1.0 or V2.0 file, or a table of a bundle given as BUNDLE:NAME.
+// V1.0 files are used in place, V2.0 files are verified and unpacked.
+void open_model(const char *filename, struct ltrmodel *model) {
+    memset(model, 0, sizeof(*model));
+    model->num_letters = NUM_LETTERS;
+    memcpy(model->alphabet, letters, NUM_LETTERS);
+
+    size_t size;
+    int mapped;
+    uint8_t *buf;
+    const char *colon = strrchr(filename, ':');
+    if (colon && access(filename, F_OK)) {
+        char *bundle = strndup(filename, colon - filename);
+        if (!bundle)
+            die("Unable to allocate memory for %s", filename);
+        buf = read_bundle(bundle, colon + 1, &size, &mapped);
+        free(bundle);
+    } else {
+        buf = read_file(filename, &size, &mapped);
+    }
+    if (size >= sizeof(struct ltrb_header) && !memcmp(buf, "LTRB V1", 8)) {
+        struct ltrb_header h;
+        memcpy(&h, buf, sizeof(h));
+        fprintf(stderr, "File %s is a bundle, give one of its tables as %s:NAME, from:", filename, filename);
+        for (uint32_t i = 0; i < h.num_tables && sizeof(h) + (i + 1) * sizeof(struct ltrb_entry) <= size; i++)
+            fprintf(stderr, " %.48s", ((const struct ltrb_entry *)(buf + sizeof(h)))[i].name);
+        die("");
+    }
+    if (size >= 8 && !memcmp(buf, "LTR V2.0", 8)) {
+        load_ltr2(filename, buf, size, model);
+        model->format = 2;
+        if (mapped)
+            munmap(buf, size);
+        else
+            free(buf);
+        return;
+    }
+
+    if (size < 9)
+        die("File %s has no valid LTR header", filename);
+    model->ltr = (struct ltrfile *)buf;
+    model->mapped = mapped ? size : 0;
+    model->format = 1;
+    check_header(filename, model->ltr);
+    if (size < sizeof(struct ltrfile))
+        die("Unable to read the prob table from %s. Truncated file?", filename);
 }
 
 void fix_ltr(struct ltrfile *ltr) {
@@ -206,260 +1176,3038 @@ void fix_ltr(struct ltrfile *ltr) {
     }
 }
 
-void build_ltr(const char *filename, struct ltrfile *ltr) {
-    memset(ltr, 0, sizeof(*ltr));
-    strncpy(ltr->header.magic, "LTR V1.0", 8);
-    ltr->header.num_letters = NUM_LETTERS;
+// Per letter probabilities of a CDF row, as seen by a linear scan for the first
+// threshold above a uniform random number. Zeros are skipped, and whatever is
+// left above the largest threshold is returned as the "no letter" probability.
+static double row_pdf(const ltrfloat *row, int num_letters, double *pdf) {
+    double max = 0.0;
+    for (int i = 0; i < num_letters; i++) {
+        pdf[i] = row[i] > max ? row[i] - max : 0.0;
+        if (row[i] > max) max = row[i];
+    }
+    return max < 1.0 ? 1.0 - max : 0.0;
+}
 
-    char buf[256] = {0};
-    while (scanf("%255s", buf) == 1) {
-        char buf2[256] = {0};
-        char *p = buf2, *q = buf2;
-        for (char *r = buf; *r; r++) {
-            if ((*r) == '#') // stop on # to allow comments
-                break;
-            *r = tolower(*r);
-            if (idx(*r) == -1) {
-                fprintf(stderr, "Invalid character %c (%02x) in name \"%s\". Skipping character.\n", *r, (uint8_t)*r, buf);
-                fflush(stderr);
-                continue;
-            }
-            *q++ = *r;
-        }
-        *q = '\0';
+// Rewrites a CDF row from per letter probabilities, normalized to sum to 1.
+// Letters with a probability of 0 get a threshold of 0, so scans skip them.
+static void set_row_pdf(ltrfloat *row, int num_letters, const double *pdf) {
+    double total = 0.0, acc = 0.0;
+    for (int i = 0; i < num_letters; i++)
+        total += pdf[i];
+    for (int i = 0; i < num_letters; i++) {
+        acc += pdf[i];
+        row[i] = pdf[i] > 0.0 ? (float)(acc / total) : 0.0f;
+    }
+}
 
-        if ((q - buf2) < 3) { // we need at least 3 characters in a name
-            fprintf(stderr, "Name \"%s\" is too short. Skipping name.\n", buf2);
-            fflush(stderr);
-            continue;
+struct alias_data *build_alias(const struct ltrdata *data, int num_letters) {
+    const int n = NUM_LETTERS + 1;
+    int num_rows = 0;
+    for (int r = 0; r < NUM_ROWS; r++) {
+        const ltrfloat *row = ltr_row(data, r);
+        for (int i = 0; i < num_letters; i++) {
+            if (row[i] > 0.0) { num_rows++; break; }
         }
+    }
 
-        q--;
-
-        ltr->data.singles.start[idx(p[0])]                       += 1.0;
-        ltr->data.doubles[idx(p[0])].start[idx(p[1])]            += 1.0;
-        ltr->data.triples[idx(p[0])][idx(p[1])].start[idx(p[2])] += 1.0;
+    struct alias_data *alias = malloc(sizeof(*alias) + num_rows * sizeof(struct alias_row));
+    if (!alias)
+        die("Unable to allocate alias tables");
+    alias->num_rows = 0;
 
-        ltr->data.singles.end[idx(q[0])]                         += 1.0;
-        ltr->data.doubles[idx(q[-1])].end[idx(q[0])]             += 1.0;
-        ltr->data.triples[idx(q[-2])][idx(q[-1])].end[idx(q[0])] += 1.0;
+    for (int r = 0; r < NUM_ROWS; r++) {
+        double p[NUM_LETTERS + 1] = {0};
+        int small[NUM_LETTERS + 1], large[NUM_LETTERS + 1];
+        int ns = 0, nl = 0;
 
-        if ((q - p) == 2) continue; // No middle
-        while (++p != q-2) {
-            ltr->data.singles.middle[idx(p[0])]                       += 1.0;
-            ltr->data.doubles[idx(p[0])].middle[idx(p[1])]            += 1.0;
-            ltr->data.triples[idx(p[0])][idx(p[1])].middle[idx(p[2])] += 1.0;
+        p[NUM_LETTERS] = row_pdf(ltr_row(data, r), num_letters, p);
+        if (p[NUM_LETTERS] == 1.0) {
+            alias->rowidx[r] = -1;
+            continue;
         }
-    }
 
-    {
-        float s = 0.0, m = 0.0, e = 0.0;
-        int startcount = 0, midcount = 0, endcount = 0;
-        for (int i = 0; i < ltr->header.num_letters; i++) {
-            startcount += (int)ltr->data.singles.start[i];
-            endcount += (int)ltr->data.singles.end[i];
-            midcount += (int)ltr->data.singles.middle[i];
-        }
-        for (int i = 0; i < ltr->header.num_letters; i++) {
-            if (ltr->data.singles.start[i] > 0.0) {
-                ltr->data.singles.start[i] /= (float)startcount;
-                s = ltr->data.singles.start[i] += s;
-            }
-            if (ltr->data.singles.end[i] > 0.0) {
-                ltr->data.singles.end[i] /= (float)endcount;
-                e = ltr->data.singles.end[i] += e;
-            }
-            if (ltr->data.singles.middle[i] > 0.0) {
-                ltr->data.singles.middle[i] /= (float)midcount;
-                m = ltr->data.singles.middle[i] += m;
-            }
+        double total = 0.0;
+        for (int i = 0; i < n; i++)
+            total += p[i];
+        for (int i = 0; i < n; i++) {
+            p[i] = p[i] * n / total;
+            if (p[i] < 1.0) small[ns++] = i;
+            else            large[nl++] = i;
         }
-    }
-    for (int i = 0; i < ltr->header.num_letters; i++) {
-        float s = 0.0, m = 0.0, e = 0.0;
-        int startcount = 0, midcount = 0, endcount = 0;
-        for (int j = 0; j < ltr->header.num_letters; j++) {
-            startcount += (int)ltr->data.doubles[i].start[j];
-            endcount += (int)ltr->data.doubles[i].end[j];
-            midcount += (int)ltr->data.doubles[i].middle[j];
-        }
-        for (int j = 0; j < ltr->header.num_letters; j++) {
-            if (ltr->data.doubles[i].start[j] > 0.0) {
-                ltr->data.doubles[i].start[j] /= (float)startcount;
-                s = ltr->data.doubles[i].start[j] += s;
-            }
-            if (ltr->data.doubles[i].end[j] > 0.0) {
-                ltr->data.doubles[i].end[j] /= (float)endcount;
-                e = ltr->data.doubles[i].end[j] += e;
-            }
-            if (ltr->data.doubles[i].middle[j] > 0.0) {
-                ltr->data.doubles[i].middle[j] /= (float)midcount;
-                m = ltr->data.doubles[i].middle[j] += m;
-            }
+
+        struct alias_row *a = &alias->rows[alias->num_rows];
+        alias->rowidx[r] = alias->num_rows++;
+        while (ns > 0 && nl > 0) {
+            int l = small[--ns], g = large[--nl];
+            a->cut[l]   = (uint32_t)(p[l] * 2147483648.0);
+            a->alias[l] = g;
+            p[g] = (p[g] + p[l]) - 1.0;
+            if (p[g] < 1.0) small[ns++] = g;
+            else            large[nl++] = g;
         }
+        // Leftovers are 1.0 up to rounding error
+        while (nl > 0) { int g = large[--nl]; a->cut[g] = 2147483648u; a->alias[g] = g; }
+        while (ns > 0) { int l = small[--ns]; a->cut[l] = 2147483648u; a->alias[l] = l; }
     }
-    for (int i = 0; i < ltr->header.num_letters; i++) {
-        for (int j = 0; j < ltr->header.num_letters; j++) {
-            float s = 0.0, m = 0.0, e = 0.0;
-            int startcount = 0, midcount = 0, endcount = 0;
-            for (int k = 0; k < ltr->header.num_letters; k++) {
-                startcount += (int)ltr->data.triples[i][j].start[k];
-                endcount += (int)ltr->data.triples[i][j].end[k];
-                midcount += (int)ltr->data.triples[i][j].middle[k];
-            }
-            for (int k = 0; k < ltr->header.num_letters; k++) {
-                if (ltr->data.triples[i][j].start[k] > 0.0) {
-                    ltr->data.triples[i][j].start[k] /= (float)startcount;
-                    s = ltr->data.triples[i][j].start[k] += s;
-                }
-                if (ltr->data.triples[i][j].end[k] > 0.0) {
-                    ltr->data.triples[i][j].end[k] /= (float)endcount;
-                    e = ltr->data.triples[i][j].end[k] += e;
-                }
-                if (ltr->data.triples[i][j].middle[k] > 0.0) {
-                    ltr->data.triples[i][j].middle[k] /= (float)midcount;
-                    m = ltr->data.triples[i][j].middle[k] += m;
-                }
+    return alias;
+}
+
+struct sparse_data *build_sparse(const struct ltrdata *data, int num_letters) {
+    struct sparse_data *sparse = malloc(sizeof(*sparse));
+    uint32_t num_cells = 0;
+    for (int r = 0; r < NUM_ROWS; r++)
+        for (int i = 0; i < num_letters; i++)
+            num_cells += ltr_row(data, r)[i] > 0.0f;
+
+    if (!sparse || !(sparse->letter = malloc(num_cells + 1)) || !(sparse->cut = malloc((num_cells + 1) * sizeof(float))))
+        die("Unable to allocate sparse tables");
+
+    uint32_t c = 0;
+    for (int r = 0; r < NUM_ROWS; r++) {
+        const ltrfloat *row = ltr_row(data, r);
+        sparse->rowptr[r] = c;
+        for (int i = 0; i < num_letters; i++) {
+            if (row[i] > 0.0f) {
+                sparse->letter[c] = i;
+                sparse->cut[c++]  = row[i];
             }
         }
     }
+    sparse->rowptr[NUM_ROWS] = c;
 
-    FILE *f = fopen(filename, "wb");
-    if (!f) die("Unable to create file %s", filename);
-    fwrite(&ltr->header, 9, 1, f);
-    fwrite(&ltr->data, sizeof(ltr->data), 1, f);
-    fclose(f);
+    size_t dense_bytes  = sizeof(struct ltrdata);
+    size_t sparse_bytes = sizeof(sparse->rowptr) + c * (sizeof(uint8_t) + sizeof(float));
+    uint32_t nonempty = 0;
+    for (int r = 0; r < NUM_ROWS; r++)
+        nonempty += sparse->rowptr[r + 1] > sparse->rowptr[r];
+    fprintf(stderr, "Sparse tables: %u cells in %u non-empty rows, %zu KB instead of %zu KB dense. "
+            "A full row scan reads %.1f bytes instead of %zu\n", c, nonempty, sparse_bytes / 1024, dense_bytes / 1024,
+            nonempty ? (double)c * (sizeof(uint8_t) + sizeof(float)) / nonempty : 0.0, NUM_LETTERS * sizeof(float));
+    fflush(stderr);
+    return sparse;
 }
 
-void print_ltr(struct ltrfile *ltr) {
-    printf("Num letters: %d\n", ltr->header.num_letters);
-    printf("Sequence | CDF(start)  P(start) | CDF(middle)  P(middle) | CDF(end)  P(end)\n");
-
-    float s = 0.0, m = 0.0, e = 0.0;
-    for (int i = 0; i < ltr->header.num_letters; i++) {
-        struct cdf *p = &ltr->data.singles;
-        printf("%c        |% .5f    % .5f  |% .5f     % .5f   |% .5f  % .5f\n", letters[i],
-                p->start[i],  p->start[i]  == 0.0 ? 0.0 : p->start[i]  - s,
-                p->middle[i], p->middle[i] == 0.0 ? 0.0 : p->middle[i] - m,
-                p->end[i],    p->end[i]    == 0.0 ? 0.0 : p->end[i]    - e);
+void free_sparse(struct sparse_data *sparse) {
+    if (sparse) {
+        free(sparse->letter);
+        free(sparse->cut);
+        free(sparse);
+    }
+}
 
-        if (p->start[i]  > 0.0) s = p->start[i];
-        if (p->middle[i] > 0.0) m = p->middle[i];
-        if (p->end[i]    > 0.0) e = p->end[i];
+// Number of draws r the scans see below threshold t, i.e. with (float)r / RNG_MAX
+// less than t. The compare is monotonic in r, so that is the first r it fails.
+static uint32_t draws_below(float t) {
+    uint32_t lo = 0, hi = (uint32_t)RNG_MAX + 1;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if ((float)(int)mid / RNG_MAX < t)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
+    return lo;
+}
 
-    for (int i = 0; i < ltr->header.num_letters; i++) {
-        s = m = e = 0.0;
-        for (int j = 0; j < ltr->header.num_letters; j++) {
-            struct cdf *p = &ltr->data.doubles[i];
-            printf("%c%c       |% .5f    % .5f  |% .5f     % .5f   |% .5f  % .5f\n", letters[i], letters[j],
-                    p->start[j],  p->start[j]  == 0.0 ? 0.0 : p->start[j]  - s,
-                    p->middle[j], p->middle[j] == 0.0 ? 0.0 : p->middle[j] - m,
-                    p->end[j],    p->end[j]    == 0.0 ? 0.0 : p->end[j]    - e);
+struct quant_data *build_quant(const struct ltrdata *data, int num_letters, int bits) {
+    struct quant_data *quant = calloc(1, sizeof(*quant));
+    if (quant && bits == 16)
+        quant->q16 = malloc(NUM_ROWS * NUM_LETTERS * sizeof(int16_t));
+    else if (quant)
+        quant->q32 = malloc(NUM_ROWS * NUM_LETTERS * sizeof(int32_t));
+    if (!quant || !(quant->q16 || quant->q32))
+        die("Unable to allocate quantized tables");
+    quant->bits = bits;
 
-            if (p->start[j]  > 0.0) s = p->start[j];
-            if (p->middle[j] > 0.0) m = p->middle[j];
-            if (p->end[j]    > 0.0) e = p->end[j];
+    // The error is measured on the distribution of a row (the letters and "no
+    // letter"), between what the float scan picks and what the cells pick
+    uint32_t cells = 0, nonempty = 0;
+    double max_err = 0.0, max_tv = 0.0, sum_tv = 0.0;
+    for (int r = 0; r < NUM_ROWS; r++) {
+        const ltrfloat *row = ltr_row(data, r);
+        uint32_t prev = 0, qprev = 0;
+        double tv = 0.0;
+        for (int i = 0; i < NUM_LETTERS; i++) {
+            const uint32_t n = i < num_letters ? draws_below(row[i]) : 0;
+            uint32_t q = n;
+            if (bits == 16) {
+                // Round to 16 bits, keeping every letter the float scan can
+                // pick possible, and 2^16 out of reach of the int16 cells
+                q = (n + (1u << 14)) >> 15;
+                if (n > prev && q <= qprev >> 15)
+                    q = (qprev >> 15) + 1;
+                if (q > 0xffff)
+                    q = 0xffff;
+                quant->q16[r * NUM_LETTERS + i] = (int)q - 32768;
+                q <<= 15;
+            } else {
+                quant->q32[r * NUM_LETTERS + i] = (int32_t)(q - 0x80000000u);
+            }
+            if (n > 0) {
+                const double err = fabs((double)q / 2147483648.0 - row[i]);
+                max_err = err > max_err ? err : max_err;
+                cells++;
+            }
+            tv += fabs((double)(n > prev ? n - prev : 0) - (q > qprev ? q - qprev : 0));
+            prev  = n > prev ? n : prev;
+            qprev = q > qprev ? q : qprev;
+        }
+        if (prev) {
+            tv = (tv + fabs((double)prev - qprev)) / 2 / 2147483648.0;
+            max_tv = tv > max_tv ? tv : max_tv;
+            sum_tv += tv;
+            nonempty++;
         }
     }
 
-    for (int i = 0; i < ltr->header.num_letters; i++) {
-        for (int j = 0; j < ltr->header.num_letters; j++) {
-            s = m = e = 0.0;
-            for (int k = 0; k < ltr->header.num_letters; k++) {
-                struct cdf *p = &ltr->data.triples[i][j];
-                printf("%c%c%c      |% .5f    % .5f  |% .5f     % .5f   |% .5f  % .5f\n", letters[i], letters[j], letters[k],
-                        p->start[k],  p->start[k]  == 0.0 ? 0.0 : p->start[k]  - s,
-                        p->middle[k], p->middle[k] == 0.0 ? 0.0 : p->middle[k] - m,
-                        p->end[k],    p->end[k]    == 0.0 ? 0.0 : p->end[k]    - e);
+    fprintf(stderr, "Quantized tables: %u thresholds in %u non-empty rows to %d bit, %zu KB instead of %zu KB. "
+            "Largest threshold error %.3g, total variation of a row from the float scans %.3g at most, %.3g on average\n",
+            cells, nonempty, bits, NUM_ROWS * NUM_LETTERS * (size_t)bits / 8 / 1024, sizeof(struct ltrdata) / 1024,
+            max_err, max_tv, nonempty ? sum_tv / nonempty : 0.0);
+    fflush(stderr);
+    return quant;
+}
 
-                if (p->start[k]  > 0.0) s = p->start[k];
-                if (p->middle[k] > 0.0) m = p->middle[k];
-                if (p->end[k]    > 0.0) e = p->end[k];
-            }
-        }
+void free_quant(struct quant_data *quant) {
+    if (quant) {
+        free(quant->q16);
+        free(quant->q32);
+        free(quant);
     }
 }
 
-const char *random_name(struct ltrfile *ltr) {
-    static char namebuf[256];
-    int attempts;
-    char *p;
-    float prob;
-    int i;
+// Relayout of whichever dense rows pick() would scan, so build the quantized
+// tables, if any, first
+struct layout_data *build_layout(const struct ltrmodel *model) {
+    const struct quant_data *quant = model->quant;
+    const uint8_t *rows = !quant ? (const uint8_t *)&model->ltr->data
+                        : quant->bits == 16 ? (const uint8_t *)quant->q16 : (const uint8_t *)quant->q32;
+    struct layout_data *layout = malloc(sizeof(*layout));
+    if (!layout)
+        die("Unable to allocate hot/cold tables");
+    layout->row_bytes = NUM_LETTERS * (quant ? (size_t)quant->bits / 8 : sizeof(float));
+    layout->stride = (2 * layout->row_bytes + 63) & ~(size_t)63;
+    if (!(layout->hot = aligned_alloc(64, NUM_CDFS * layout->stride)) ||
+        !(layout->cold = malloc(NUM_CDFS * layout->row_bytes)))
+        die("Unable to allocate hot/cold tables");
 
-again:
-    attempts = 0;
-    p = &namebuf[0];
+    // Lines a step touches, here and where the rows were
+    size_t lines = 0, flat_lines = 0;
+    for (int idx = 0; idx < NUM_CDFS; idx++) {
+        const size_t rb = layout->row_bytes;
+        uint8_t *slot = layout->hot + idx * layout->stride;
+        memcpy(layout->cold + idx * rb, rows + (3 * idx + ROW_START) * rb, rb);
+        memcpy(slot, rows + (3 * idx + ROW_MIDDLE) * rb, rb);
+        memcpy(slot + rb, rows + (3 * idx + ROW_END) * rb, rb);
+        memset(slot + 2 * rb, 0, layout->stride - 2 * rb);
 
-    for (i = 0, prob = nrand(); i < ltr->header.num_letters; i++)
-        if (prob < ltr->data.singles.start[i])
-            break;
-    // This can happen if the training set was too small
-    if (i == ltr->header.num_letters)
-        goto again;
-    *p++ = letters[i];
+        const uintptr_t first = (uintptr_t)(rows + (3 * idx + ROW_MIDDLE) * rb);
+        flat_lines += (first + 2 * rb - 1) / 64 - first / 64 + 1;
+        lines += (2 * rb + 63) / 64;
+    }
 
-    for (i = 0, prob = nrand(); i < ltr->header.num_letters; i++)
-        if (prob < ltr->data.doubles[idx(p[-1])].start[i])
-            break;
-    if (i == ltr->header.num_letters)
-        goto again;
-    *p++ = letters[i];
+    fprintf(stderr, "Hot/cold tables: %zu KB of middle and end rows in %zu byte slots, %zu KB of start rows. "
+            "A step reads %.2f cache lines instead of %.2f\n", NUM_CDFS * layout->stride / 1024, layout->stride,
+            NUM_CDFS * layout->row_bytes / 1024, (double)lines / NUM_CDFS, (double)flat_lines / NUM_CDFS);
+    fflush(stderr);
+    return layout;
+}
 
-    for (i = 0, prob = nrand(); i < ltr->header.num_letters; i++)
-        if (prob < ltr->data.triples[idx(p[-2])][idx(p[-1])].start[i])
-            break;
-    if (i == ltr->header.num_letters)
-        goto again;
-    *p++ = letters[i];
+static const void *layout_row(const struct layout_data *layout, int row) {
+    const int idx = row / 3, kind = row - 3 * idx;
+    if (kind == ROW_START)
+        return layout->cold + idx * layout->row_bytes;
+    return layout->hot + idx * layout->stride + (kind - ROW_MIDDLE) * layout->row_bytes;
+}
+
+void free_layout(struct layout_data *layout) {
+    if (layout) {
+        free(layout->hot);
+        free(layout->cold);
+        free(layout);
+    }
+}
+
+void close_model(struct ltrmodel *model) {
+    if (model->mapped)
+        munmap(model->ltr, model->mapped);
+    else
+        free(model->ltr);
+    free(model->counts);
+    free(model->alias);
+    free_sparse(model->sparse);
+    free_quant(model->quant);
+    free_layout(model->layout);
+    memset(model, 0, sizeof(*model));
+}
+
+// Reads the start, middle and end rows of CDF number idx (see NUM_CDFS) back
+// into dense form, from whichever layout the model samples from.
+static void get_cdf(const struct ltrmodel *model, int idx, struct cdf *out) {
+    if (!model->sparse) {
+        *out = ((const struct cdf *)&model->ltr->data)[idx];
+        return;
+    }
+    memset(out, 0, sizeof(*out));
+    for (int kind = 0; kind < 3; kind++) {
+        int row = 3 * idx + kind;
+        ltrfloat *dst = (ltrfloat *)out + kind * NUM_LETTERS;
+        for (uint32_t c = model->sparse->rowptr[row]; c < model->sparse->rowptr[row + 1]; c++)
+            dst[model->sparse->letter[c]] = model->sparse->cut[c];
+    }
+}
+
+// Turns every row of counts into a CDF. The division and the running sum are
+// done in float exactly as the original tool did, so small corpora still
+// give the same bits, but the counts themselves no longer saturate at 2^24.
+static void build_cdfs(const struct ltrcounts *counts, struct ltrdata *data) {
+    for (int row = 0; row < NUM_ROWS; row++) {
+        const uint64_t *c = count_row((struct ltrcounts *)counts, row);
+        ltrfloat *cdf = (ltrfloat *)ltr_row(data, row);
+        uint64_t total = 0;
+        for (int i = 0; i < NUM_LETTERS; i++)
+            total += c[i];
+        float acc = 0.0;
+        for (int i = 0; i < NUM_LETTERS; i++)
+            cdf[i] = c[i] ? (acc = (float)c[i] / (float)total + acc) : 0.0f;
+    }
+}
+
+// Gets the counts of a V1.0 file from its sidecar. The sidecar also holds the
+// CDFs, which must still match the file, or the counts are out of date.
+void open_counts(const char *filename, struct ltrmodel *model, int required) {
+    if (model->counts)
+        return;
+    char *sidecar = count_file(filename);
+    if (access(sidecar, R_OK) && !required) {
+        free(sidecar);
+        return;
+    }
+    if (access(sidecar, R_OK))
+        die("No n-gram counts for %s: it is not a v2 file and has no %s. Rebuild it with -b", filename, sidecar);
+
+    struct ltrmodel side;
+    open_model(sidecar, &side);
+    if (!side.counts || memcmp(&side.ltr->data, &model->ltr->data, sizeof(struct ltrdata)))
+        die("The counts in %s do not match %s. Rebuild it with -b", sidecar, filename);
+    model->counts = side.counts;
+    model->smoothed |= side.smoothed;
+    side.counts = NULL;
+    close_model(&side);
+    free(sidecar);
+}
+
+// Counts one word, filtered through the letter indexes ix[]. Problems with
+// the word are reported to log.
+static void count_name(struct ltrcounts *c, const int8_t *ix, char *buf, FILE *log) {
+    char buf2[256] = {0};
+    char *q = buf2;
+    for (char *r = buf; *r; r++) {
+        if ((*r) == '#') // stop on # to allow comments
+            break;
+        *r = tolower(*r);
+        if (ix[(uint8_t)*r] == -1) {
+            fprintf(log, "Invalid character %c (%02x) in name \"%s\". Skipping character.\n", *r, (uint8_t)*r, buf);
+            fflush(log);
+            continue;
+        }
+        *q++ = *r;
+    }
+    *q = '\0';
+
+    if ((q - buf2) < 3) { // we need at least 3 characters in a name
+        fprintf(log, "Name \"%s\" is too short. Skipping name.\n", buf2);
+        fflush(log);
+        return;
+    }
+
+    uint8_t name[256];
+    uint8_t *p = name, *e = name + (q - buf2) - 1;
+    for (int i = 0; buf2[i]; i++)
+        name[i] = ix[(uint8_t)buf2[i]];
+
+    c->singles.start[p[0]]              += 1;
+    c->doubles[p[0]].start[p[1]]        += 1;
+    c->triples[p[0]][p[1]].start[p[2]]  += 1;
+
+    c->singles.end[e[0]]                += 1;
+    c->doubles[e[-1]].end[e[0]]         += 1;
+    c->triples[e[-2]][e[-1]].end[e[0]]  += 1;
+
+    if ((e - p) == 2) return; // No middle
+    while (++p != e-2) {
+        c->singles.middle[p[0]]             += 1;
+        c->doubles[p[0]].middle[p[1]]       += 1;
+        c->triples[p[0]][p[1]].middle[p[2]] += 1;
+    }
+}
+
+// Input files are split into one newline aligned chunk per thread. Every
+// thread counts its chunk into its own tables and buffers its messages, and
+// both are merged in chunk order, so the result and the messages are the
+// same as when reading the file on one thread.
+// With --tagged, every line is "tag<TAB>words" and each tag gets its own
+// counts, kept in the order the tags are first seen.
+#define MAX_TAG 64
+struct tagcounts {
+    char              tag[MAX_TAG];
+    struct ltrcounts *counts;
+};
+
+struct count_worker {
+    pthread_t         thread;
+    const char       *begin, *end;
+    const int8_t     *ix;
+    struct ltrcounts *counts;    // NULL with --tagged
+    struct tagcounts *tags;
+    int               num_tags;
+    char             *log;
+    size_t            logsize;
+};
+
+// Same words as scanf("%255s") gives: runs of non-space characters, cut into
+// pieces of at most 255. Words never span a newline, so neither do they span
+// chunks.
+static void count_words(struct ltrcounts *counts, const int8_t *ix, const char *p, const char *end, FILE *log) {
+    char buf[256];
+    for (;;) {
+        while (p < end && isspace((uint8_t)*p))
+            p++;
+        if (p == end)
+            break;
+        size_t len = 0;
+        while (p < end && !isspace((uint8_t)*p) && len < sizeof(buf) - 1)
+            buf[len++] = *p++;
+        buf[len] = '\0';
+        count_name(counts, ix, buf, log);
+    }
+}
+
+static struct tagcounts *find_tag(struct tagcounts **tags, int *num_tags, const char *tag, size_t len) {
+    for (int i = *num_tags - 1; i >= 0; i--) // input is usually grouped by tag
+        if (!strncmp((*tags)[i].tag, tag, len) && !(*tags)[i].tag[len])
+            return &(*tags)[i];
+    if (!(*num_tags & (*num_tags - 1)) && !(*tags = realloc(*tags, 2 * (*num_tags + 1) * sizeof(**tags))))
+        die("Unable to allocate memory for the tags");
+    struct tagcounts *t = &(*tags)[(*num_tags)++];
+    memcpy(t->tag, tag, len);
+    t->tag[len] = '\0';
+    if (!(t->counts = calloc(1, sizeof(*t->counts))))
+        die("Unable to allocate memory for the tables");
+    return t;
+}
+
+static void *count_chunk(void *arg) {
+    struct count_worker *w = arg;
+    FILE *log = open_memstream(&w->log, &w->logsize);
+    if (!log)
+        die("Unable to allocate memory for messages");
+
+    if (w->counts) {
+        count_words(w->counts, w->ix, w->begin, w->end, log);
+        fclose(log);
+        return NULL;
+    }
+
+    for (const char *line = w->begin, *eol; line < w->end; line = eol + 1) {
+        if (!(eol = memchr(line, '\n', w->end - line)))
+            eol = w->end;
+        // Tags become file names, so keep them to a single path component
+        const char *tab = memchr(line, '\t', eol - line);
+        size_t len = tab ? (size_t)(tab - line) : 0;
+        if (!len || len >= MAX_TAG || memchr(line, '/', len) || memchr(line, '\0', len) ||
+            (line[0] == '.' && (len == 1 || (len == 2 && line[1] == '.')))) {
+            const char *e = eol;
+            while (e > line && isspace((uint8_t)e[-1]))
+                e--;
+            if (e > line)
+                fprintf(log, "No valid tag in line \"%.*s\". Skipping line.\n", (int)(e - line), line);
+            continue;
+        }
+        struct tagcounts *t = find_tag(&w->tags, &w->num_tags, line, len);
+        count_words(t->counts, w->ix, tab + 1, eol, log);
+    }
+    fclose(log);
+    return NULL;
+}
+
+static void count_input(struct count_worker *workers, int threads, const char *filename) {
+    size_t size;
+    int mapped;
+    const char *buf = (const char *)read_file(filename, &size, &mapped);
+    if (mapped)
+        madvise((void *)buf, size, MADV_SEQUENTIAL);
+
+    const char *at = buf, *end = buf + size;
+    for (int t = 0; t < threads; t++) {
+        const char *split = end;
+        if (t < threads - 1) {
+            const char *from = buf + size / threads * (t + 1);
+            if (from < at)
+                from = at;
+            if (!(split = memchr(from, '\n', end - from)))
+                split = end;
+        }
+        workers[t].begin = at;
+        workers[t].end = at = split;
+        if (t > 0 && pthread_create(&workers[t].thread, NULL, count_chunk, &workers[t]))
+            die("Unable to create thread");
+    }
+    count_chunk(&workers[0]);
+    for (int t = 0; t < threads; t++) {
+        if (t > 0)
+            pthread_join(workers[t].thread, NULL);
+        fwrite(workers[t].log, 1, workers[t].logsize, stderr);
+        free(workers[t].log);
+    }
+    fflush(stderr);
+
+    if (mapped)
+        munmap((void *)buf, size);
+    else
+        free((void *)buf);
+}
+
+// Index of every character in the alphabet of the model, -1 if not in it
+static void letter_indexes(int8_t ix[256], const struct ltrmodel *model) {
+    memset(ix, -1, 256);
+    for (int i = 0; i < model->num_letters; i++)
+        ix[(uint8_t)model->alphabet[i]] = i;
+}
+
+// Counts the names in the given files, or on stdin if there are none, into
+// model->counts and rebuilds the CDFs from them
+void add_names(struct ltrmodel *model, char **files, int num_files, int threads) {
+    int8_t ix[256];
+    letter_indexes(ix, model);
+
+    if (num_files == 0) {
+        char buf[256] = {0};
+        while (scanf("%255s", buf) == 1)
+            count_name(model->counts, ix, buf, stderr);
+        build_cdfs(model->counts, &model->ltr->data);
+        return;
+    }
+
+    struct count_worker *workers = calloc(threads, sizeof(*workers));
+    if (!workers)
+        die("Unable to allocate %d workers", threads);
+    for (int t = 0; t < threads; t++) {
+        workers[t].ix = ix;
+        workers[t].counts = t == 0 ? model->counts : calloc(1, sizeof(struct ltrcounts));
+        if (!workers[t].counts)
+            die("Unable to allocate memory for the tables");
+    }
+
+    for (int i = 0; i < num_files; i++)
+        count_input(workers, threads, files[i]);
+
+    for (int t = 1; t < threads; t++) {
+        for (int row = 0; row < NUM_ROWS; row++)
+            for (int k = 0; k < NUM_LETTERS; k++)
+                count_row(model->counts, row)[k] += count_row(workers[t].counts, row)[k];
+        free(workers[t].counts);
+    }
+    free(workers);
+    build_cdfs(model->counts, &model->ltr->data);
+}
+
+// Empty tables and counts for the given letters
+static void new_model(struct ltrmodel *model, const char *alphabet) {
+    memset(model, 0, sizeof(*model));
+    if (!(model->ltr = calloc(1, sizeof(*model->ltr))) || !(model->counts = calloc(1, sizeof(*model->counts))))
+        die("Unable to allocate memory for the tables");
+    struct ltrfile *ltr = model->ltr;
+    strncpy(ltr->header.magic, "LTR V1.0", 8);
+    ltr->header.num_letters = NUM_LETTERS;
+
+    model->num_letters = strlen(alphabet);
+    if (model->num_letters > NUM_LETTERS)
+        die("Alphabet \"%s\" has more than %d letters", alphabet, NUM_LETTERS);
+    const char *bad = alphabet_error(alphabet, model->num_letters);
+    if (bad)
+        die("Alphabet \"%s\" %s", alphabet, bad);
+    strcpy(model->alphabet, alphabet);
+    model->format = 1;
+}
+
+void build_ltr(struct ltrmodel *model, const char *alphabet, char **files, int num_files, int threads) {
+    new_model(model, alphabet);
+    add_names(model, files, num_files, threads);
+}
+
+// Gives every state the generator can reach a middle letter to go on with, so
+// it never has to back off from one. SMOOTH_BACKOFF fills empty middle rows
+// from the pair row of the last letter, or from the singles if that is empty
+// too. End rows are left alone: a state that can't end can still go on.
+// SMOOTH_ADDK adds k to the counts of every letter in the middle and end
+// rows of every reachable state. Filled rows make more states reachable, so
+// this runs to a fixed point. Returns the number of states that were filled.
+int smooth_ltr(struct ltrmodel *model, int mode, double k) {
+    const int n = model->num_letters;
+    struct ltrdata *d = &model->ltr->data;
+    if (mode == SMOOTH_ADDK && !model->counts)
+        die("--smooth=addk needs the n-gram counts of the table, use --smooth=backoff");
+
+    uint8_t reached[NUM_LETTERS][NUM_LETTERS] = {{0}}, done[NUM_LETTERS][NUM_LETTERS] = {{0}};
+    double p1[NUM_LETTERS], p2[NUM_LETTERS], p3[NUM_LETTERS];
+    row_pdf(d->singles.start, n, p1);
+    for (int a = 0; a < n; a++) {
+        if (p1[a] <= 0.0)
+            continue;
+        row_pdf(d->doubles[a].start, n, p2);
+        for (int b = 0; b < n; b++) {
+            if (p2[b] <= 0.0)
+                continue;
+            row_pdf(d->triples[a][b].start, n, p3);
+            for (int c = 0; c < n; c++)
+                reached[b][c] |= p3[c] > 0.0;
+        }
+    }
+
+    int filled = 0, states = 0;
+    for (int changed = 1; changed; ) {
+        changed = 0;
+        for (int a = 0; a < n; a++) {
+            for (int b = 0; b < n; b++) {
+                if (!reached[a][b] || done[a][b])
+                    continue;
+                done[a][b] = 1;
+                states++;
+
+                double pdf[NUM_LETTERS];
+                ltrfloat *middle = d->triples[a][b].middle;
+                int empty = row_pdf(middle, n, pdf) >= 1.0;
+                if (mode == SMOOTH_ADDK) {
+                    for (int kind = ROW_MIDDLE; kind <= ROW_END; kind++) {
+                        const uint64_t *c = count_row(model->counts, TRIPLE_ROW(a, b, kind));
+                        for (int i = 0; i < n; i++)
+                            pdf[i] = c[i] + k;
+                        set_row_pdf((ltrfloat *)ltr_row(d, TRIPLE_ROW(a, b, kind)), n, pdf);
+                    }
+                    filled += empty;
+                } else if (empty && (row_pdf(d->doubles[b].middle, n, pdf) < 1.0 ||
+                                     row_pdf(d->singles.middle, n, pdf) < 1.0)) {
+                    set_row_pdf(middle, n, pdf);
+                    filled++;
+                }
+
+                double mp[NUM_LETTERS];
+                row_pdf(d->triples[a][b].middle, n, mp);
+                for (int c = 0; c < n; c++) {
+                    if (mp[c] > 0.0 && !reached[b][c])
+                        reached[b][c] = changed = 1;
+                }
+            }
+        }
+    }
+
+    fprintf(stderr, "Smoothing filled %d of %d reachable states\n", filled, states);
+    model->smoothed |= mode == SMOOTH_ADDK || filled;
+    return filled;
+}
+
+// Builds <dir>/<tag>.ltr for every tag in a tagged corpus, in one pass
+void build_tagged(const char *dir, const char *alphabet, char **files, int num_files, int threads, int format,
+                  int smooth, double k) {
+    static char *stdin_file[] = { "/dev/stdin" };
+    if (num_files == 0) {
+        files = stdin_file;
+        num_files = 1;
+    }
+
+    struct ltrmodel model;
+    new_model(&model, alphabet);
+    int8_t ix[256];
+    letter_indexes(ix, &model);
+
+    struct count_worker *workers = calloc(threads, sizeof(*workers));
+    if (!workers)
+        die("Unable to allocate %d workers", threads);
+    for (int t = 0; t < threads; t++)
+        workers[t].ix = ix;
+    for (int i = 0; i < num_files; i++)
+        count_input(workers, threads, files[i]);
+
+    struct tagcounts *tags = NULL;
+    int num_tags = 0;
+    for (int t = 0; t < threads; t++) {
+        for (int i = 0; i < workers[t].num_tags; i++) {
+            struct tagcounts *w = &workers[t].tags[i];
+            struct ltrcounts *sum = find_tag(&tags, &num_tags, w->tag, strlen(w->tag))->counts;
+            for (int row = 0; row < NUM_ROWS; row++)
+                for (int k = 0; k < NUM_LETTERS; k++)
+                    count_row(sum, row)[k] += count_row(w->counts, row)[k];
+            free(w->counts);
+        }
+        free(workers[t].tags);
+    }
+    free(workers);
+    if (num_tags == 0)
+        die("No tagged names in the input");
+
+    struct stat st;
+    if (stat(dir, &st) && mkdir(dir, 0777))
+        die("Unable to create directory %s", dir);
+    char *filename = malloc(strlen(dir) + MAX_TAG + 6);
+    if (!filename)
+        die("Unable to allocate memory for the file names");
+    struct ltrcounts *counts = model.counts;
+    for (int i = 0; i < num_tags; i++) {
+        unsigned long long names = 0;
+        for (int k = 0; k < NUM_LETTERS; k++)
+            names += tags[i].counts->singles.start[k];
+        model.counts = tags[i].counts;
+        build_cdfs(model.counts, &model.ltr->data);
+        sprintf(filename, "%s/%s.ltr", dir, tags[i].tag);
+        if (smooth) {
+            fprintf(stderr, "%s: ", filename);
+            smooth_ltr(&model, smooth, k);
+        }
+        write_ltr(filename, &model, format);
+        fprintf(stderr, "Built %s from %llu names\n", filename, names);
+        free(tags[i].counts);
+    }
+    model.counts = counts;
+    free(filename);
+    free(tags);
+    close_model(&model);
+}
+
+// Mixes the tables given as FILE:WEIGHT (weight 1 if left out). If all of
+// them have counts, the counts are mixed, each table scaled to the same
+// number of names times its weight, so a context counts for as much as the
+// tables saw it. The result is scaled back up to the combined number of
+// names, and keeps counts, so it can be updated or blended again.
+// Otherwise the letter probabilities of every row are mixed, over the tables
+// that have the row.
+void blend_ltr(struct ltrmodel *model, char **specs, int num_specs, int nofix) {
+    struct ltrmodel *in = calloc(num_specs, sizeof(*in));
+    double *weight = calloc(num_specs, sizeof(*weight)), *names = calloc(num_specs, sizeof(*names));
+    if (!in || !weight || !names)
+        die("Unable to allocate memory for %d tables", num_specs);
+
+    double total_weight = 0.0, total_names = 0.0;
+    int counted = 1;
+    for (int i = 0; i < num_specs; i++) {
+        char *filename = strdup(specs[i]), *colon = strrchr(filename, ':'), *end;
+        if (!filename)
+            die("Unable to allocate memory for %s", specs[i]);
+        // FILE may be BUNDLE:NAME itself, so what follows the last ':' is
+        // only a weight if it is a number
+        weight[i] = colon ? strtod(colon + 1, &end) : 1.0;
+        if (colon && end != colon + 1 && !*end) {
+            if (!(weight[i] >= 0.0))
+                die("Invalid weight in %s", specs[i]);
+            *colon = '\0';
+        } else {
+            weight[i] = 1.0;
+        }
+        open_model(filename, &in[i]);
+        open_counts(filename, &in[i], 0);
+        if (!nofix)
+            fix_ltr(in[i].ltr);
+        if (strcmp(in[i].alphabet, in[0].alphabet))
+            die("Can't blend %s, its letters \"%s\" are not \"%s\"", filename, in[i].alphabet, in[0].alphabet);
+        if ((counted &= in[i].counts != NULL)) {
+            for (int k = 0; k < NUM_LETTERS; k++)
+                names[i] += in[i].counts->singles.start[k];
+            if (names[i] == 0.0)
+                die("Can't blend %s, it has no names", filename);
+            total_names += names[i];
+        }
+        total_weight += weight[i];
+        free(filename);
+    }
+    if (!(total_weight > 0.0))
+        die("The blend weights add up to zero");
+
+    new_model(model, in[0].alphabet);
+    const int n = model->num_letters;
+    if (counted) {
+        fprintf(stderr, "Blending the counts of %d tables\n", num_specs);
+        for (int row = 0; row < NUM_ROWS; row++) {
+            for (int k = 0; k < n; k++) {
+                double c = 0.0;
+                for (int i = 0; i < num_specs; i++)
+                    c += weight[i] / total_weight * count_row(in[i].counts, row)[k] / names[i];
+                // Don't let rare transitions round away
+                c *= total_names;
+                count_row(model->counts, row)[k] = c <= 0.0 ? 0 : c < 1.0 ? 1 : (uint64_t)(c + 0.5);
+            }
+        }
+        build_cdfs(model->counts, &model->ltr->data);
+    } else {
+        fprintf(stderr, "Not all tables have counts, blending their probabilities\n");
+        free(model->counts);
+        model->counts = NULL;
+        for (int row = 0; row < NUM_ROWS; row++) {
+            double pdf[NUM_LETTERS] = {0}, p[NUM_LETTERS];
+            for (int i = 0; i < num_specs; i++) {
+                double none = row_pdf(ltr_row(&in[i].ltr->data, row), n, p);
+                if (none < 1.0)
+                    for (int k = 0; k < n; k++)
+                        pdf[k] += weight[i] * p[k] / (1.0 - none);
+            }
+            set_row_pdf((ltrfloat *)ltr_row(&model->ltr->data, row), n, pdf);
+        }
+    }
+
+    for (int i = 0; i < num_specs; i++)
+        close_model(&in[i]);
+    free(in);
+    free(weight);
+    free(names);
+}
+
+// Packs tables into one bundle (see struct ltrb_header), named after their
+// files without the extension. Directories stand for all the .ltr files in
+// them. Tables are fixed unless nofix, and written in format, with their
+// counts if it has room for them.
+struct pack_item {
+    struct ltrb_entry e;
+    char             *path;
+};
+
+static int compare_items(const void *a, const void *b) {
+    return strcmp(((const struct pack_item *)a)->e.name, ((const struct pack_item *)b)->e.name);
+}
+
+static void add_item(struct pack_item **items, int *num, int *cap, const char *dir, const char *file) {
+    if (*num == *cap && !(*items = realloc(*items, (*cap = *cap ? 2 * *cap : 32) * sizeof(**items))))
+        die("Unable to allocate memory for %d tables", *cap);
+    struct pack_item *it = &(*items)[(*num)++];
+    memset(it, 0, sizeof(*it));
+    if (!(it->path = malloc(strlen(dir) + strlen(file) + 2)))
+        die("Unable to allocate memory for %s", file);
+    if (*dir)
+        sprintf(it->path, "%s%s%s", dir, dir[strlen(dir) - 1] == '/' ? "" : "/", file);
+    else
+        strcpy(it->path, file);
+
+    const char *base = strrchr(it->path, '/') ? strrchr(it->path, '/') + 1 : it->path;
+    const char *ext = strrchr(base, '.');
+    const size_t len = ext && ext != base ? (size_t)(ext - base) : strlen(base);
+    if (len == 0 || len >= sizeof(it->e.name) || memchr(base, ':', len))
+        die("Can't pack %s: table names must be 1 to %zu characters, without ':'", it->path, sizeof(it->e.name) - 1);
+    memcpy(it->e.name, base, len);
+}
+
+void pack_ltrs(char **paths, int num_paths, const char *output, int format, int nofix) {
+    struct pack_item *items = NULL;
+    int num = 0, cap = 0;
+    for (int p = 0; p < num_paths; p++) {
+        DIR *dir = opendir(paths[p]);
+        if (!dir) {
+            add_item(&items, &num, &cap, "", paths[p]);
+            continue;
+        }
+        struct dirent *d;
+        while ((d = readdir(dir))) {
+            const size_t len = strlen(d->d_name);
+            if (len > 4 && !strcmp(d->d_name + len - 4, ".ltr"))
+                add_item(&items, &num, &cap, paths[p], d->d_name);
+        }
+        closedir(dir);
+    }
+    if (num == 0)
+        die("No .ltr files to pack");
+    qsort(items, num, sizeof(*items), compare_items);
+    for (int i = 1; i < num; i++)
+        if (!strcmp(items[i - 1].e.name, items[i].e.name))
+            die("Can't pack both %s and %s as %s", items[i - 1].path, items[i].path, items[i].e.name);
+
+    char *tmpname = malloc(strlen(output) + 5);
+    if (!tmpname)
+        die("Unable to allocate memory for %s", output);
+    FILE *f = fopen(strcat(strcpy(tmpname, output), ".tmp"), "wb");
+    if (!f) die("Unable to create file %s", output);
+
+    // The tables first, each from a page boundary, then the index in front
+    uint64_t offset = sizeof(struct ltrb_header) + (uint64_t)num * sizeof(struct ltrb_entry), tables = 0;
+    for (int i = 0; i < num; i++) {
+        struct ltrmodel model;
+        open_model(items[i].path, &model);
+        open_counts(items[i].path, &model, 0);
+        if (!nofix)
+            fix_ltr(model.ltr);
+        items[i].e.offset = offset = (offset + LTRB_PAGE - 1) & ~(uint64_t)(LTRB_PAGE - 1);
+        if (fseek(f, offset, SEEK_SET))
+            die("Unable to write file %s", output);
+        write_table(f, items[i].path, &model, format);
+        offset += items[i].e.size = ftell(f) - offset;
+        tables += items[i].e.size;
+        close_model(&model);
+    }
+
+    struct ltrb_header h = { "LTRB V1", num, LTRB_PAGE, 0, 0 };
+    struct ltrb_entry *index = malloc(num * sizeof(*index));
+    if (!index)
+        die("Unable to allocate memory for %s", output);
+    for (int i = 0; i < num; i++)
+        index[i] = items[i].e;
+    h.crc_index  = crc32(index, num * sizeof(*index));
+    h.crc_header = crc32(&h, offsetof(struct ltrb_header, crc_header));
+    rewind(f);
+    fwrite(&h, sizeof(h), 1, f);
+    fwrite(index, sizeof(*index), num, f);
+    finish_file(f, tmpname, output);
+
+    fprintf(stderr, "Packed %d tables into %s: %llu KB, of which %llu KB of V%d.0 tables\n", num, output,
+            (unsigned long long)offset / 1024, (unsigned long long)tables / 1024, format);
+    fflush(stderr);
+    for (int i = 0; i < num; i++)
+        free(items[i].path);
+    free(items);
+    free(index);
+}
+
+void print_ltr(const struct ltrmodel *model) {
+    struct cdf c, *p = &c;
+    printf("Num letters: %d\n", model->num_letters);
+    printf("Sequence | CDF(start)  P(start) | CDF(middle)  P(middle) | CDF(end)  P(end)\n");
+
+    float s = 0.0, m = 0.0, e = 0.0;
+    get_cdf(model, 0, p);
+    for (int i = 0; i < model->num_letters; i++) {
+        printf("%c        |% .5f    % .5f  |% .5f     % .5f   |% .5f  % .5f\n", model->alphabet[i],
+                p->start[i],  p->start[i]  == 0.0 ? 0.0 : p->start[i]  - s,
+                p->middle[i], p->middle[i] == 0.0 ? 0.0 : p->middle[i] - m,
+                p->end[i],    p->end[i]    == 0.0 ? 0.0 : p->end[i]    - e);
+
+        if (p->start[i]  > 0.0) s = p->start[i];
+        if (p->middle[i] > 0.0) m = p->middle[i];
+        if (p->end[i]    > 0.0) e = p->end[i];
+    }
+
+    for (int i = 0; i < model->num_letters; i++) {
+        s = m = e = 0.0;
+        get_cdf(model, 1 + i, p);
+        for (int j = 0; j < model->num_letters; j++) {
+            printf("%c%c       |% .5f    % .5f  |% .5f     % .5f   |% .5f  % .5f\n", model->alphabet[i], model->alphabet[j],
+                    p->start[j],  p->start[j]  == 0.0 ? 0.0 : p->start[j]  - s,
+                    p->middle[j], p->middle[j] == 0.0 ? 0.0 : p->middle[j] - m,
+                    p->end[j],    p->end[j]    == 0.0 ? 0.0 : p->end[j]    - e);
+
+            if (p->start[j]  > 0.0) s = p->start[j];
+            if (p->middle[j] > 0.0) m = p->middle[j];
+            if (p->end[j]    > 0.0) e = p->end[j];
+        }
+    }
+
+    for (int i = 0; i < model->num_letters; i++) {
+        for (int j = 0; j < model->num_letters; j++) {
+            s = m = e = 0.0;
+            get_cdf(model, 1 + NUM_LETTERS + i * NUM_LETTERS + j, p);
+            for (int k = 0; k < model->num_letters; k++) {
+                printf("%c%c%c      |% .5f    % .5f  |% .5f     % .5f   |% .5f  % .5f\n", model->alphabet[i], model->alphabet[j], model->alphabet[k],
+                        p->start[k],  p->start[k]  == 0.0 ? 0.0 : p->start[k]  - s,
+                        p->middle[k], p->middle[k] == 0.0 ? 0.0 : p->middle[k] - m,
+                        p->end[k],    p->end[k]    == 0.0 ? 0.0 : p->end[k]    - e);
+
+                if (p->start[k]  > 0.0) s = p->start[k];
+                if (p->middle[k] > 0.0) m = p->middle[k];
+                if (p->end[k]    > 0.0) e = p->end[k];
+            }
+        }
+    }
+}
+
+// Per generator random number state. This is the same additive feedback
+// generator glibc uses behind rand(), so a given seed still produces the names
+// it always did, but every generator owns its state instead of sharing one
+// global behind a lock.
+// In counter mode, draws come from Philox4x32-10 instead, keyed by the seed
+// and counting (name index, block). Name number i is then a pure function of
+// the seed and i, no matter which thread, machine or libc generates it.
+struct rng {
+    int32_t  state[31];
+    int      f, r;
+
+    int      counter;
+    uint32_t key[2];
+    uint64_t index;   // of the next name
+    uint64_t name;    // index of the name being generated
+    uint32_t block;
+    uint32_t out[4];
+    int      avail;
+};
+
+static int next_rng(struct rng *rng) {
+    if (rng->counter) {
+        if (rng->avail == 0) {
+            const uint32_t ctr[4] = { rng->block++, (uint32_t)rng->name, (uint32_t)(rng->name >> 32), 0 };
+            philox(rng->key, ctr, rng->out);
+            rng->avail = 4;
+        }
+        return rng->out[4 - rng->avail--] >> 1;
+    }
+
+    uint32_t val = (uint32_t)rng->state[rng->f] + (uint32_t)rng->state[rng->r];
+    rng->state[rng->f] = val;
+    if (++rng->f == 31) rng->f = 0;
+    if (++rng->r == 31) rng->r = 0;
+    return val >> 1;
+}
+
+static void seed_rng(struct rng *rng, uint32_t seed) {
+    int32_t word = seed ? (int32_t)seed : 1;
+    rng->state[0] = word;
+    for (int i = 1; i < 31; i++) {
+        int64_t hi = word / 127773, lo = word % 127773;
+        word = 16807 * lo - 2836 * hi;
+        if (word < 0)
+            word += 2147483647;
+        rng->state[i] = word;
+    }
+    rng->f = 3;
+    rng->r = 0;
+    rng->counter = 0;
+    for (int i = 0; i < 310; i++)
+        next_rng(rng);
+}
+
+static void seed_counter_rng(struct rng *rng, uint32_t seed, uint64_t index) {
+    rng->counter = 1;
+    rng->key[0]  = seed;
+    rng->key[1]  = 0;
+    rng->index   = index;
+    rng->avail   = 0;
+}
+
+// Called once per name, restarts included, so counter mode draws from the
+// stream of that name only.
+static void begin_name(struct rng *rng) {
+    if (rng->counter) {
+        rng->name  = rng->index++;
+        rng->block = 0;
+        rng->avail = 0;
+    }
+}
+
+// Sampler counters, only collected by generators with collect_stats set
+struct genstats {
+    uint64_t names;
+    uint64_t draws;
+    uint64_t restarts;   // all names started over, aborts included
+    uint64_t backtracks;
+    uint64_t aborts;     // restarts after more than 100 backtracks
+    uint64_t lengths[256];
+};
+
+// Reentrant name generator. The model is only ever read, so any number of
+// generators (e.g. one per thread) can share the same one.
+struct ltrgen {
+    const struct ltrmodel *model;
+    struct rng             rng;
+    int                    collect_stats;
+    struct genstats        stats;
+    char                   namebuf[256];
+};
+
+static void add_stats(struct genstats *total, const struct genstats *s) {
+    total->names      += s->names;
+    total->draws      += s->draws;
+    total->restarts   += s->restarts;
+    total->backtracks += s->backtracks;
+    total->aborts     += s->aborts;
+    for (int i = 0; i < 256; i++)
+        total->lengths[i] += s->lengths[i];
+}
+
+void init_gen(struct ltrgen *gen, const struct ltrmodel *model, uint32_t seed) {
+    memset(gen, 0, sizeof(*gen));
+    gen->model = model;
+    seed_rng(&gen->rng, seed);
+}
+
+// Returns the index of the letter picked from a row by the random number r, or
+// num_letters if the row has nothing for it.
+static int pick(const struct ltrmodel *model, int row, int r) {
+    if (model->alias) {
+        const struct alias_data *alias = model->alias;
+        if (alias->rowidx[row] < 0)
+            return model->ltr->header.num_letters;
+        const struct alias_row *a = &alias->rows[alias->rowidx[row]];
+        uint64_t x = (uint64_t)r * (NUM_LETTERS + 1);
+        uint32_t col = x >> 31;
+        return ((uint32_t)x & 0x7fffffff) < a->cut[col] ? (int)col : a->alias[col];
+    }
+
+    if (model->sparse) {
+        const struct sparse_data *sparse = model->sparse;
+        float prob = (float)r / RNG_MAX;
+        for (uint32_t c = sparse->rowptr[row]; c < sparse->rowptr[row + 1]; c++)
+            if (prob < sparse->cut[c])
+                return sparse->letter[c];
+        return model->ltr->header.num_letters;
+    }
+
+    if (model->layout) {
+        const void *cells = layout_row(model->layout, row);
+        if (!model->quant)
+            return scan_row(cells, (float)r / RNG_MAX);
+        if (model->quant->bits == 16)
+            return scan_q16_row(cells, r);
+        return scan_q32_row(cells, r);
+    }
+
+    if (model->quant) {
+        if (model->quant->bits == 16)
+            return scan_q16_row(model->quant->q16 + row * NUM_LETTERS, r);
+        return scan_q32_row(model->quant->q32 + row * NUM_LETTERS, r);
+    }
+
+    return scan_row(ltr_row(&model->ltr->data, row), (float)r / RNG_MAX);
+}
+
+static inline int draw(struct ltrgen *gen, const int stats) {
+    if (stats)
+        gen->stats.draws++;
+    return next_rng(&gen->rng);
+}
+
+// Generates a name into buf (including the terminator) and returns its length.
+// Names that would not fit in len bytes are discarded and generated anew.
+// With force_end set (--force-end), a state that has no middle letters ends
+// the name even when the end test fails, as backing off from it would only
+// waste the draws that led there.
+
+// The body is instantiated twice, with and without stats, so that the counters
+// cost nothing unless asked for.
+#define STAT(x) do { if (stats) gen->stats.x; } while (0)
+static inline __attribute__((always_inline))
+size_t generate_name(struct ltrgen *gen, char *buf, size_t len, const int stats) {
+    const struct ltrmodel *model = gen->model;
+    const int n = model->ltr->header.num_letters;
+    const size_t maxlen = (len < sizeof(gen->namebuf) ? len : sizeof(gen->namebuf)) - 1;
+    uint8_t name[sizeof(gen->namebuf)];
+    uint8_t *p;
+    int attempts;
+    int r;
+    int i;
+
+    if (len < 5) { // 3 start letters, at least one end letter and the terminator
+        if (len) buf[0] = '\0';
+        return 0;
+    }
+
+    int restarts = -1;
+    begin_name(&gen->rng);
+again:
+    restarts++;
+    attempts = 0;
+    p = &name[0];
+
+    i = pick(model, SINGLE_ROW(ROW_START), draw(gen, stats));
+    // This can happen if the training set was too small
+    if (i == n)
+        goto again;
+    *p++ = i;
+
+    i = pick(model, DOUBLE_ROW(p[-1], ROW_START), draw(gen, stats));
+    if (i == n)
+        goto again;
+    *p++ = i;
+
+    i = pick(model, TRIPLE_ROW(p[-2], p[-1], ROW_START), draw(gen, stats));
+    if (i == n)
+        goto again;
+    *p++ = i;
+
+    while (1) {
+        r = draw(gen, stats);
+        // Arbitrary end threshold form the core game
+        if ((draw(gen, stats) % 12) <= (p - name)) {
+            i = pick(model, TRIPLE_ROW(p[-2], p[-1], ROW_END), r);
+            if (i != n) {
+                *p++ = i;
+                break;
+            }
+        }
+
+        i = pick(model, TRIPLE_ROW(p[-2], p[-1], ROW_MIDDLE), r);
+        if (i == n && model->force_end) {
+            i = pick(model, TRIPLE_ROW(p[-2], p[-1], ROW_END), r);
+            if (i != n) {
+                *p++ = i;
+                break;
+            }
+        }
+        if (i == n) {
+            STAT(backtracks++);
+            if (--p - name < 3)
+                goto again;
+            if (++attempts > 100) {
+                STAT(aborts++);
+                goto again;
+            }
+        } else if ((size_t)(p - name) + 1 < maxlen) { // leave room for the end letter
+            *p++ = i;
+        } else {
+            goto again;
+        }
+    }
+
+    size_t length = p - name;
+    STAT(names++);
+    STAT(restarts += restarts);
+    STAT(lengths[length]++);
+    for (size_t j = 0; j < length; j++)
+        buf[j] = model->alphabet[name[j]];
+    buf[0] = toupper(buf[0]);
+    buf[length] = '\0';
+    return length;
+}
+#undef STAT
+
+// Constrained names (--min-len, --max-len, --prefix, --suffix). Rather than
+// throwing away the names that miss the constraints, the generator is steered
+// towards them: win(L, a, b, s) is the chance that a name of L letters ending
+// in a,b, whose last s letters are the start of the suffix, is completed within
+// the constraints. Every letter is then picked in proportion to its chance
+// times the win of where it leads. With the chances of name_step(), which fold
+// in the backing off, that gives the names of generate_name() conditioned on
+// meeting the constraints.
+struct constraint {
+    int       min_len, max_len;
+    int       prefix_len, suffix_len;
+    uint8_t   prefix[256];
+    uint16_t (*next)[NUM_LETTERS]; // suffix matcher, next[s][letter]
+    double   *win;
+    double   *start;               // cumulative weight of all starts a,b,c
+    struct backoff *backoff;
+};
+#define WIN(c, L, a, b, s) \
+    ((c)->win[(((size_t)(L) * NUM_LETTERS + (a)) * NUM_LETTERS + (b)) * ((c)->suffix_len + 1) + (s)])
+
+// Chances of the outcomes of one step of generate_name() from the state a,b
+// with len letters: end[i] of ending with letter i, middle[j] of going on with
+// letter j. Both picks use the same random number, so when the end test
+// passes but the end row has nothing for it, the middle letter is one past
+// the end row's total. With force_end it's the same the other way around.
+static void step_probs(const struct ltrmodel *model, int a, int b, int len, double *end, double *middle) {
+    const int n = model->ltr->header.num_letters;
+    const ltrfloat *er = model->ltr->data.triples[a][b].end, *mr = model->ltr->data.triples[a][b].middle;
+    const double q = (len + 1 < 12 ? len + 1 : 12) / 12.0;
+    double lo = 0.0;
+    for (int i = 0; i < n; i++) {
+        end[i] = er[i] > lo ? q * (er[i] - lo) : 0.0;
+        if (er[i] > lo) lo = er[i];
+    }
+    const double etotal = lo;
+    lo = 0.0;
+    for (int j = 0; j < n; j++) {
+        middle[j] = 0.0;
+        if (mr[j] > lo) {
+            double past = mr[j] - (lo > etotal ? lo : etotal);
+            middle[j] = (1.0 - q) * (mr[j] - lo) + (past > 0.0 ? q * past : 0.0);
+            lo = mr[j];
+        }
+    }
+    const double mtotal = lo;
+    if (model->force_end) {
+        lo = 0.0;
+        for (int i = 0; i < n; i++) {
+            if (er[i] > lo) {
+                double past = er[i] - (lo > mtotal ? lo : mtotal);
+                if (past > 0.0)
+                    end[i] += (1.0 - q) * past;
+                lo = er[i];
+            }
+        }
+    }
+}
+
+// step_probs() leaves out that generate_name() backs off: when a step has
+// nothing to pick, the last letter is dropped and the step before it is taken
+// anew, and dropping one of the 3 start letters starts the name over. Steps
+// only depend on the last two letters and the length, so where that leads
+// does too: done(L, a, b) is the chance that a name at a,b with L letters is
+// finished without dropping b, and back(L, a, b) that b is dropped. Going on
+// with letter j comes back to a,b with the chance back(L + 1, b, j), and the
+// step is then taken again, so every outcome of a step is fold(L, a, b) times
+// as likely as step_probs() says. A name's chance is then the product of its
+// start and folded steps, over the chance success that an attempt gives a
+// name at all. The abort after 100 backtracks is not modelled.
+struct backoff {
+    double success;
+    double fold[256][NUM_LETTERS][NUM_LETTERS];
+    double done[256][NUM_LETTERS][NUM_LETTERS];
+    double back[256][NUM_LETTERS][NUM_LETTERS];
+};
+
+static struct backoff *new_backoff(const struct ltrmodel *model) {
+    const int n = model->ltr->header.num_letters;
+    const struct ltrdata *d = &model->ltr->data;
+    struct backoff *bo = calloc(1, sizeof(*bo));
+    if (!bo)
+        die("Unable to allocate memory for the backoff tables");
+
+    // Names have at most 255 letters, so at 254 a name can only end
+    for (int L = 254; L >= 3; L--) {
+        for (int a = 0; a < n; a++) {
+            for (int b = 0; b < n; b++) {
+                double end[NUM_LETTERS], middle[NUM_LETTERS], e = 0.0, m = 0.0, ret = 0.0, fin = 0.0;
+                step_probs(model, a, b, L, end, middle);
+                for (int i = 0; i < n; i++) {
+                    e += end[i];
+                    m += middle[i];
+                    if (L < 254) {
+                        ret += middle[i] * bo->back[L + 1][b][i];
+                        fin += middle[i] * bo->done[L + 1][b][i];
+                    }
+                }
+                // A state that always comes back never gives a name
+                if (ret < 1.0 - 1e-12) {
+                    const double fold = 1.0 / (1.0 - ret);
+                    bo->fold[L][a][b] = fold;
+                    bo->done[L][a][b] = (e + fin) * fold;
+                    bo->back[L][a][b] = (e + m < 1.0 ? 1.0 - e - m : 0.0) * fold;
+                }
+            }
+        }
+    }
+
+    double p1[NUM_LETTERS], p2[NUM_LETTERS], p3[NUM_LETTERS];
+    row_pdf(d->singles.start, n, p1);
+    for (int a = 0; a < n; a++) {
+        row_pdf(d->doubles[a].start, n, p2);
+        for (int b = 0; b < n; b++) {
+            row_pdf(d->triples[a][b].start, n, p3);
+            for (int c = 0; c < n; c++)
+                bo->success += p1[a] * p2[b] * p3[c] * bo->done[3][b][c];
+        }
+    }
+    return bo;
+}
+
+// step_probs() with the backoff folded in
+static void name_step(const struct ltrmodel *model, const struct backoff *bo, int a, int b, int len, double *end,
+                      double *middle) {
+    const int n = model->ltr->header.num_letters;
+    const double fold = bo->fold[len][a][b];
+    step_probs(model, a, b, len, end, middle);
+    for (int i = 0; i < n; i++) {
+        end[i] *= fold;
+        middle[i] *= len < 254 ? fold : 0.0;
+    }
+}
+
+static int letters_of(const struct ltrmodel *model, const char *str, uint8_t *out) {
+    int len = 0;
+    for (; str[len]; len++) {
+        const char *c = memchr(model->alphabet, tolower((uint8_t)str[len]), model->num_letters);
+        if (len >= 255)
+            die("\"%s\" is too long for a name", str);
+        if (!c)
+            die("Can't use \"%s\": '%c' is not one of the letters \"%s\"", str, str[len], model->alphabet);
+        out[len] = c - model->alphabet;
+    }
+    return len;
+}
+
+struct constraint *new_constraint(const struct ltrmodel *model, int min_len, int max_len, const char *prefix,
+                                  const char *suffix) {
+    const int n = model->ltr->header.num_letters;
+    struct constraint *c = calloc(1, sizeof(*c));
+    uint8_t pat[256];
+    if (!c)
+        die("Unable to allocate memory for the constraints");
+    c->min_len = min_len < 4 ? 4 : min_len;
+    c->max_len = max_len <= 0 || max_len > 255 ? 255 : max_len;
+    c->prefix_len = prefix ? letters_of(model, prefix, c->prefix) : 0;
+    c->suffix_len = suffix ? letters_of(model, suffix, pat) : 0;
+    if (c->min_len > c->max_len)
+        die("No name can be %d to %d letters long", c->min_len, c->max_len);
+
+    // KMP automaton: the state is the length of the longest tail of the name
+    // that starts the suffix
+    const int S = c->suffix_len + 1;
+    int fail[256] = {0};
+    c->next = calloc(S, sizeof(*c->next));
+    c->win = calloc((size_t)(c->max_len + 1) * NUM_LETTERS * NUM_LETTERS * S, sizeof(double));
+    c->start = malloc((size_t)NUM_LETTERS * NUM_LETTERS * NUM_LETTERS * sizeof(double));
+    c->backoff = new_backoff(model);
+    if (!c->next || !c->win || !c->start)
+        die("Unable to allocate memory for the constraints");
+    for (int s = 1, k = 0; s < c->suffix_len; s++) {
+        while (k > 0 && pat[s] != pat[k])
+            k = fail[k - 1];
+        fail[s] = k += pat[s] == pat[k];
+    }
+    for (int s = 0; s < S; s++)
+        for (int i = 0; i < NUM_LETTERS; i++)
+            c->next[s][i] = s < c->suffix_len && pat[s] == i ? s + 1 : s == 0 ? 0 : c->next[fail[s - 1]][i];
+
+    for (int L = c->max_len - 1; L >= 3; L--) {
+        for (int a = 0; a < n; a++) {
+            for (int b = 0; b < n; b++) {
+                double end[NUM_LETTERS], middle[NUM_LETTERS];
+                name_step(model, c->backoff, a, b, L, end, middle);
+                for (int s = 0; s < S; s++) {
+                    double w = 0.0;
+                    for (int i = 0; i < n; i++) {
+                        if (L < c->prefix_len && i != c->prefix[L])
+                            continue;
+                        int t = c->next[s][i];
+                        if (L + 1 >= c->min_len && t == c->suffix_len)
+                            w += end[i];
+                        if (L + 2 <= c->max_len)
+                            w += middle[i] * WIN(c, L + 1, b, i, t);
+                    }
+                    WIN(c, L, a, b, s) = w;
+                }
+            }
+        }
+    }
+
+    double total = 0.0, p1[NUM_LETTERS], p2[NUM_LETTERS], p3[NUM_LETTERS];
+    row_pdf(model->ltr->data.singles.start, n, p1);
+    for (int a = 0; a < NUM_LETTERS; a++) {
+        if (a < n)
+            row_pdf(model->ltr->data.doubles[a].start, n, p2);
+        for (int b = 0; b < NUM_LETTERS; b++) {
+            if (a < n && b < n)
+                row_pdf(model->ltr->data.triples[a][b].start, n, p3);
+            for (int k = 0; k < NUM_LETTERS; k++) {
+                const uint8_t abc[3] = { a, b, k };
+                int ok = a < n && b < n && k < n, s = 0;
+                for (int i = 0; i < 3 && ok; i++) {
+                    ok = i >= c->prefix_len || abc[i] == c->prefix[i];
+                    s = c->next[s][abc[i]];
+                }
+                if (ok)
+                    total += p1[a] * p2[b] * p3[k] * WIN(c, 3, b, k, s);
+                c->start[(a * NUM_LETTERS + b) * NUM_LETTERS + k] = total;
+            }
+        }
+    }
+    if (!(total > 0.0))
+        die("No name from this table can meet the constraints");
+    return c;
+}
+
+void free_constraint(struct constraint *c) {
+    if (c) {
+        free(c->next);
+        free(c->win);
+        free(c->start);
+        free(c->backoff);
+        free(c);
+    }
+}
+
+// Uniform in [0, 1) from two draws
+static double draw_uniform(struct ltrgen *gen) {
+    uint64_t hi = next_rng(&gen->rng), lo = next_rng(&gen->rng);
+    if (gen->collect_stats)
+        gen->stats.draws += 2;
+    return (double)(hi << 31 | lo) / 4611686018427387904.0;
+}
+
+static size_t constrained_name(struct ltrgen *gen, char *buf, size_t len) {
+    const struct ltrmodel *model = gen->model;
+    const struct constraint *c = model->constraint;
+    const int n = model->ltr->header.num_letters;
+    const int N3 = NUM_LETTERS * NUM_LETTERS * NUM_LETTERS;
+    uint8_t name[256];
+
+    if (len <= (size_t)c->max_len) { // constraints were set up for longer names
+        if (len) buf[0] = '\0';
+        return 0;
+    }
+    begin_name(&gen->rng);
+
+    double u = draw_uniform(gen) * c->start[N3 - 1];
+    int lo = 0, hi = N3 - 1;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (c->start[mid] > u)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    name[0] = lo / (NUM_LETTERS * NUM_LETTERS);
+    name[1] = lo / NUM_LETTERS % NUM_LETTERS;
+    name[2] = lo % NUM_LETTERS;
+    int L = 3, s = 0, ended = 0;
+    for (int i = 0; i < 3; i++)
+        s = c->next[s][name[i]];
+
+    while (!ended) {
+        const int a = name[L - 2], b = name[L - 1];
+        double end[NUM_LETTERS], middle[NUM_LETTERS];
+        name_step(model, c->backoff, a, b, L, end, middle);
+        u = draw_uniform(gen) * WIN(c, L, a, b, s);
+        // If rounding leaves u past every option, the last possible one is taken
+        int pick = -1, pick_end = 0;
+        for (int i = 0; i < n && u >= 0.0; i++) {
+            if (L < c->prefix_len && i != c->prefix[L])
+                continue;
+            int t = c->next[s][i];
+            double w;
+            if (L + 1 >= c->min_len && t == c->suffix_len && (w = end[i]) > 0.0) {
+                pick = i, pick_end = 1;
+                if ((u -= w) < 0.0)
+                    break;
+            }
+            if (L + 2 <= c->max_len && (w = middle[i] * WIN(c, L + 1, b, i, t)) > 0.0) {
+                pick = i, pick_end = 0;
+                u -= w;
+            }
+        }
+        name[L++] = pick;
+        s = c->next[s][pick];
+        ended = pick_end;
+    }
+
+    if (gen->collect_stats) {
+        gen->stats.names++;
+        gen->stats.lengths[L]++;
+    }
+    for (int j = 0; j < L; j++)
+        buf[j] = model->alphabet[name[j]];
+    buf[0] = toupper(buf[0]);
+    buf[L] = '\0';
+    return L;
+}
+
+size_t random_name_r(struct ltrgen *gen, char *buf, size_t len) {
+    if (gen->model->constraint)
+        return constrained_name(gen, buf, len);
+    return gen->collect_stats ? generate_name(gen, buf, len, 1) : generate_name(gen, buf, len, 0);
+}
 
-    while (1) {
-        prob = nrand();
-        // Arbitrary end threshold form the core game
-        if ((rand() % 12) <= (p - namebuf)) {
-            for (i = 0; i < ltr->header.num_letters; i++) {
-                if (prob < ltr->data.triples[idx(p[-2])][idx(p[-1])].end[i]) {
-                    *p++ = letters[i]; *p = '\0';
-                    namebuf[0] = toupper(namebuf[0]);
-                    return namebuf;
+const char *random_name(struct ltrgen *gen) {
+    random_name_r(gen, gen->namebuf, sizeof(gen->namebuf));
+    return gen->namebuf;
+}
+
+// Dead end pruning. A triples state (a,b) is live if it can end a name, or has
+// a middle letter k leading to a live state (b,k). Names that wander into a
+// dead state can only be thrown away by random_name_r(), so transitions into
+// dead states are removed and the rows renormalized. The same is done going
+// backwards through the start rows, so that a start is only ever picked if a
+// name can be completed from it.
+static int prune_row(ltrfloat *row, int num_letters, const uint8_t *keep) {
+    double pdf[NUM_LETTERS];
+    int removed = 0;
+    row_pdf(row, num_letters, pdf);
+    for (int k = 0; k < num_letters; k++) {
+        if (pdf[k] > 0.0 && !keep[k]) {
+            pdf[k] = 0.0;
+            removed++;
+        }
+    }
+    if (removed)
+        set_row_pdf(row, num_letters, pdf);
+    return removed;
+}
+
+static int row_empty(const ltrfloat *row, int num_letters) {
+    double pdf[NUM_LETTERS];
+    return row_pdf(row, num_letters, pdf) >= 1.0;
+}
+
+// Samples the generator on a shallow copy of model with the given force_end,
+// so the pruning itself is measured apart from --force-end. Returns the
+// restarts and backtracks per name.
+static double sample_dead_ends(const struct ltrmodel *model, int force_end, const char *when) {
+    enum { SAMPLE = 100000 };
+    struct ltrmodel m = *model;
+    struct ltrgen gen;
+    m.force_end = force_end;
+    init_gen(&gen, &m, 1);
+    gen.collect_stats = 1;
+    for (int i = 0; i < SAMPLE; i++)
+        random_name_r(&gen, gen.namebuf, sizeof(gen.namebuf));
+    fprintf(stderr, "%s: %.4f restarts and %.4f backtracks per name (%d names sampled)\n", when,
+            (double)gen.stats.restarts / SAMPLE, (double)gen.stats.backtracks / SAMPLE, SAMPLE);
+    return (double)(gen.stats.restarts + gen.stats.backtracks) / SAMPLE;
+}
+
+void prune_ltr(struct ltrmodel *model) {
+    const int n = model->ltr->header.num_letters;
+    struct ltrdata *d = &model->ltr->data;
+    uint8_t live[NUM_LETTERS][NUM_LETTERS], starts[NUM_LETTERS][NUM_LETTERS], firsts[NUM_LETTERS] = {0};
+    sample_dead_ends(model, 0, "Before pruning");
+
+    for (int a = 0; a < n; a++)
+        for (int b = 0; b < n; b++)
+            live[a][b] = !row_empty(d->triples[a][b].end, n);
+    for (int changed = 1; changed; ) {
+        changed = 0;
+        for (int a = 0; a < n; a++) {
+            for (int b = 0; b < n; b++) {
+                double pdf[NUM_LETTERS];
+                if (live[a][b])
+                    continue;
+                row_pdf(d->triples[a][b].middle, n, pdf);
+                for (int k = 0; k < n; k++) {
+                    if (pdf[k] > 0.0 && live[b][k]) {
+                        live[a][b] = changed = 1;
+                        break;
+                    }
                 }
             }
         }
+    }
 
-        for (i = 0; i < ltr->header.num_letters; i++) {
-            if (prob < ltr->data.triples[idx(p[-2])][idx(p[-1])].middle[i]) {
-                *p++ = letters[i];
-                break;
+    uint8_t targeted[NUM_LETTERS][NUM_LETTERS] = {{0}};
+    for (int a = 0; a < n; a++) {
+        for (int b = 0; b < n; b++) {
+            double sp[NUM_LETTERS], mp[NUM_LETTERS];
+            row_pdf(d->triples[a][b].start, n, sp);
+            row_pdf(d->triples[a][b].middle, n, mp);
+            for (int k = 0; k < n; k++)
+                targeted[b][k] |= sp[k] > 0.0 || mp[k] > 0.0;
+        }
+    }
+
+    int dead = 0, middles = 0, starts_removed = 0;
+    for (int a = 0; a < n; a++) {
+        for (int b = 0; b < n; b++) {
+            dead += targeted[a][b] && !live[a][b];
+            middles += prune_row(d->triples[a][b].middle, n, live[b]);
+            starts_removed += prune_row(d->triples[a][b].start, n, live[b]);
+        }
+    }
+    for (int a = 0; a < n; a++) {
+        for (int b = 0; b < n; b++)
+            starts[a][b] = !row_empty(d->triples[a][b].start, n);
+        starts_removed += prune_row(d->doubles[a].start, n, starts[a]);
+        firsts[a] = !row_empty(d->doubles[a].start, n);
+    }
+    starts_removed += prune_row(d->singles.start, n, firsts);
+    if (row_empty(d->singles.start, n))
+        die("No name can be completed from any start in this table");
+
+    fprintf(stderr, "Pruned %d dead states: removed %d middle and %d start transitions\n", dead, middles, starts_removed);
+    // -u rebuilds the CDFs from the counts, which would bring the pruned
+    // transitions back
+    if (model->counts && middles + starts_removed) {
+        fprintf(stderr, "Dropped the n-gram counts, which still have the pruned transitions\n");
+        free(model->counts);
+        model->counts = NULL;
+    }
+    if (sample_dead_ends(model, 0, "After pruning") > 0.0 && !model->force_end)
+        fprintf(stderr, "The rest come from states that can only end a name failing the end test, which pruning "
+                        "can't remove. Only --force-end does\n");
+    if (model->force_end)
+        sample_dead_ends(model, 1, "After pruning, with --force-end");
+    fflush(stderr);
+}
+
+// --emit-header: a model as a C/C++ header of static const alias tables with
+// an inline copy of the counter mode generator, so that programs can generate
+// the names of "nwnltr -c -a" with no file to load. The generator is shared by
+// all headers and takes the table by constant pointer, so once it is inlined
+// the compiler folds the alphabet size and the table addresses into it.
+static const char header_generator[] =
+"#ifndef NWNLTR_GENERATOR\n"
+"#define NWNLTR_GENERATOR\n"
+"#include <stddef.h>\n"
+"#include <stdint.h>\n"
+"\n"
+"#define NWNLTR_COLUMNS %d // letters and \"no letter\", the last column\n"
+"\n"
+"struct nwnltr_table {\n"
+"    int              num_letters; // of the alphabet, which sets the row numbers\n"
+"    int              force_end;   // end names in states without middle letters\n"
+"    const char      *alphabet;\n"
+"    const int16_t   *rows;        // alias row of every CDF row, -1 if empty\n"
+"    const uint32_t (*cut)[NWNLTR_COLUMNS];\n"
+"    const uint8_t  (*alias)[NWNLTR_COLUMNS];\n"
+"};\n"
+"\n"
+"// Philox4x32-10 keyed by the seed, counting (block, name index)\n"
+"struct nwnltr_rng {\n"
+"    uint32_t key[2], ctr[4], out[4];\n"
+"    int      avail;\n"
+"};\n"
+"\n"
+"static inline int nwnltr_draw(struct nwnltr_rng *rng) {\n"
+"    if (rng->avail == 0) {\n"
+"        uint32_t k0 = rng->key[0], k1 = rng->key[1];\n"
+"        uint32_t c0 = rng->ctr[0]++, c1 = rng->ctr[1], c2 = rng->ctr[2], c3 = rng->ctr[3];\n"
+"        for (int round = 0; round < 10; round++) {\n"
+"            uint64_t p0 = (uint64_t)0xD2511F53 * c0;\n"
+"            uint64_t p1 = (uint64_t)0xCD9E8D57 * c2;\n"
+"            c0 = (uint32_t)(p1 >> 32) ^ c1 ^ k0;\n"
+"            c2 = (uint32_t)(p0 >> 32) ^ c3 ^ k1;\n"
+"            c1 = (uint32_t)p1;\n"
+"            c3 = (uint32_t)p0;\n"
+"            k0 += 0x9E3779B9;\n"
+"            k1 += 0xBB67AE85;\n"
+"        }\n"
+"        rng->out[0] = c0; rng->out[1] = c1; rng->out[2] = c2; rng->out[3] = c3;\n"
+"        rng->avail = 4;\n"
+"    }\n"
+"    return (int)(rng->out[4 - rng->avail--] >> 1);\n"
+"}\n"
+"\n"
+"static inline int nwnltr_pick(const struct nwnltr_table *t, int row, int r) {\n"
+"    const int a = t->rows[row];\n"
+"    if (a < 0)\n"
+"        return NWNLTR_COLUMNS - 1;\n"
+"    const uint64_t x = (uint64_t)r * NWNLTR_COLUMNS;\n"
+"    const uint32_t col = (uint32_t)(x >> 31);\n"
+"    return ((uint32_t)x & 0x7fffffff) < t->cut[a][col] ? (int)col : t->alias[a][col];\n"
+"}\n"
+"\n"
+"// Writes name number index for the seed into buf and returns its length, or 0\n"
+"// if len is less than 5. Names that would not fit in len bytes are skipped.\n"
+"static inline size_t nwnltr_name(const struct nwnltr_table *t, uint32_t seed, uint64_t index, char *buf, size_t len) {\n"
+"    const int n = t->num_letters, none = NWNLTR_COLUMNS - 1;\n"
+"    const size_t maxlen = (len < 256 ? len : 256) - 1;\n"
+"    struct nwnltr_rng rng = { { seed, 0 }, { 0, (uint32_t)index, (uint32_t)(index >> 32), 0 }, { 0, 0, 0, 0 }, 0 };\n"
+"    uint8_t name[256], *p;\n"
+"    int attempts, row, r, i;\n"
+"\n"
+"    if (len < 5) {\n"
+"        if (len) buf[0] = '\\0';\n"
+"        return 0;\n"
+"    }\n"
+"again:\n"
+"    attempts = 0;\n"
+"    p = name;\n"
+"    if ((i = nwnltr_pick(t, 0, nwnltr_draw(&rng))) == none)\n"
+"        goto again;\n"
+"    *p++ = (uint8_t)i;\n"
+"    if ((i = nwnltr_pick(t, 3 * (1 + p[-1]), nwnltr_draw(&rng))) == none)\n"
+"        goto again;\n"
+"    *p++ = (uint8_t)i;\n"
+"    if ((i = nwnltr_pick(t, 3 * (1 + n + p[-2] * n + p[-1]), nwnltr_draw(&rng))) == none)\n"
+"        goto again;\n"
+"    *p++ = (uint8_t)i;\n"
+"\n"
+"    while (1) {\n"
+"        row = 3 * (1 + n + p[-2] * n + p[-1]);\n"
+"        r = nwnltr_draw(&rng);\n"
+"        if (nwnltr_draw(&rng) %% 12 <= p - name) {\n"
+"            if ((i = nwnltr_pick(t, row + 2, r)) != none) {\n"
+"                *p++ = (uint8_t)i;\n"
+"                break;\n"
+"            }\n"
+"        }\n"
+"        i = nwnltr_pick(t, row + 1, r);\n"
+"        if (i == none && t->force_end) {\n"
+"            if ((i = nwnltr_pick(t, row + 2, r)) != none) {\n"
+"                *p++ = (uint8_t)i;\n"
+"                break;\n"
+"            }\n"
+"        }\n"
+"        if (i == none) {\n"
+"            if (--p - name < 3 || ++attempts > 100)\n"
+"                goto again;\n"
+"        } else if ((size_t)(p - name) + 1 < maxlen) {\n"
+"            *p++ = (uint8_t)i;\n"
+"        } else {\n"
+"            goto again;\n"
+"        }\n"
+"    }\n"
+"\n"
+"    const size_t length = (size_t)(p - name);\n"
+"    for (size_t j = 0; j < length; j++)\n"
+"        buf[j] = t->alphabet[name[j]];\n"
+"    if (buf[0] >= 'a' && buf[0] <= 'z')\n"
+"        buf[0] = (char)(buf[0] - 'a' + 'A');\n"
+"    buf[length] = '\\0';\n"
+"    return length;\n"
+"}\n"
+"#endif\n";
+
+void emit_header(const char *filename, const char *source, const struct ltrmodel *model) {
+    // The C names of the tables are those of the file, e.g. elfm_name() for elfm.h
+    const char *base = strrchr(filename, '/') ? strrchr(filename, '/') + 1 : filename;
+    char id[64], guard[64];
+    int len = 0;
+    for (; base[len] && base[len] != '.' && len < (int)sizeof(id) - 2; len++) {
+        id[len] = isalnum((uint8_t)base[len]) ? tolower((uint8_t)base[len]) : '_';
+        guard[len] = toupper((uint8_t)id[len]);
+    }
+    id[len] = guard[len] = '\0';
+    if (len == 0 || isdigit((uint8_t)id[0]))
+        die("Header name %s does not start with a letter", base);
+
+    char *tmpname = malloc(strlen(filename) + 5);
+    if (!tmpname)
+        die("Unable to allocate memory for %s", filename);
+    FILE *f = fopen(strcat(strcpy(tmpname, filename), ".tmp"), "wb");
+    if (!f) die("Unable to create file %s", filename);
+
+    // Rows are renumbered for the alphabet of the file, so that a table of A
+    // letters has 3 * (1 + A + A * A) of them
+    const int n = model->num_letters, num_rows = 3 * (1 + n + n * n);
+    struct alias_data *alias = build_alias(&model->ltr->data, model->ltr->header.num_letters);
+
+    fprintf(f, "// %s: generated by nwnltr --emit-header from %s\n"
+            "//\n"
+            "// %s_name(seed, i, buf, len) writes name number i of \"nwnltr -c -a -s seed\"\n"
+            "// to buf, e.g. for (i = 0; i < 100; i++) %s_name(seed, i, buf, sizeof(buf))\n"
+            "// gives the names of -g 100.\n"
+            "#ifndef NWNLTR_%s_H\n#define NWNLTR_%s_H\n\n", base, source, id, id, guard, guard);
+    fprintf(f, header_generator, NUM_LETTERS + 1);
+
+    fprintf(f, "\nstatic const int16_t %s_rows[%d] = {", id, num_rows);
+    for (int row = 0; row < num_rows; row++) {
+        const int idx = row / 3, a = (idx - 1 - n) / n, b = (idx - 1 - n) % n;
+        const int full = idx == 0 ? row : idx <= n ? DOUBLE_ROW(idx - 1, row % 3) : TRIPLE_ROW(a, b, row % 3);
+        fprintf(f, "%s%d,", row % 16 ? " " : "\n    ", alias->rowidx[full]);
+    }
+    fprintf(f, "\n};\n\nstatic const uint32_t %s_cut[%d][%d] = {\n", id, alias->num_rows ? alias->num_rows : 1,
+            NUM_LETTERS + 1);
+    for (int a = 0; a < alias->num_rows; a++) {
+        fprintf(f, "    {");
+        for (int c = 0; c <= NUM_LETTERS; c++)
+            fprintf(f, "%s0x%08x", c ? "," : "", alias->rows[a].cut[c]);
+        fprintf(f, "},\n");
+    }
+    fprintf(f, "%s};\n\nstatic const uint8_t %s_alias[%d][%d] = {\n", alias->num_rows ? "" : "    {0},\n", id,
+            alias->num_rows ? alias->num_rows : 1, NUM_LETTERS + 1);
+    for (int a = 0; a < alias->num_rows; a++) {
+        fprintf(f, "    {");
+        for (int c = 0; c <= NUM_LETTERS; c++)
+            fprintf(f, "%s%d", c ? "," : "", alias->rows[a].alias[c]);
+        fprintf(f, "},\n");
+    }
+    fprintf(f, "%s};\n\nstatic const struct nwnltr_table %s_table = {\n    %d, %d, \"", alias->num_rows ? "" : "    {0},\n",
+            id, n, model->force_end);
+    for (int i = 0; i < n; i++) {
+        const uint8_t c = model->alphabet[i];
+        fprintf(f, c == '"' || c == '\\' ? "\\%c" : isprint(c) ? "%c" : "\\%03o", c);
+    }
+    fprintf(f, "\", %s_rows, %s_cut, %s_alias\n};\n\n"
+            "static inline size_t %s_name(uint32_t seed, uint64_t index, char *buf, size_t len) {\n"
+            "    return nwnltr_name(&%s_table, seed, index, buf, len);\n"
+            "}\n\n#endif\n", id, id, id, id, id);
+
+    fprintf(stderr, "Header %s: %d alias rows, %zu KB of tables\n", filename, alias->num_rows,
+            (num_rows * sizeof(int16_t) + alias->num_rows * (NUM_LETTERS + 1) * (sizeof(uint32_t) + 1)) / 1024);
+    fflush(stderr);
+    free(alias);
+    finish_file(f, tmpname, filename);
+}
+
+// Bulk generation. The names are cut into blocks of GEN_BLOCK that are dealt
+// round robin to the workers, each of which has its own RNG stream derived
+// from the seed. Worker 0 uses the seed as is, so a single thread produces the
+// same names as random_name() always did.
+// In counter mode all workers share the seed and start each block at its
+// global name index instead, so the output does not depend on the thread count.
+#define GEN_BLOCK 16384
+struct gen_worker {
+    pthread_t     thread;
+    struct ltrgen gen;
+    int           count;
+    char         *buf;
+    size_t        size, cap;
+    struct lanes *lanes;      // NULL to generate one name at a time
+    char         *names;      // names of the lanes, in the order they finished
+    size_t        names_cap;
+    size_t       *offsets;
+};
+
+static uint32_t stream_seed(uint32_t seed, int stream) {
+    if (stream == 0)
+        return seed;
+    // splitmix64 finalizer
+    uint64_t z = seed + (uint64_t)stream * 0x9e3779b97f4a7c15ull;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return (uint32_t)(z ^ (z >> 31));
+}
+
+// Lockstep batch generator (--lanes). Each of 8 or 16 lanes generates a name
+// of its own, and every step advances all of them at once: the draws of all
+// lanes come from one vector Philox call, every lane makes its start or end
+// pick and its middle pick with the same r, and whether it then appends, ends,
+// backs off or starts over is a select per lane instead of a branch. Lanes that
+// finish a name take the next name index, so all names are those of
+// generate_name() in counter mode, only finished in another order; they are
+// put back in index order before being written out.
+struct lanes {
+    int      num;
+    uint32_t key[2];
+    uint32_t ctr[3][MAX_LANES];     // block, name index low and high
+    uint32_t out[4][MAX_LANES];
+    uint32_t draws[MAX_LANES][16];  // ring of draws not used yet
+    uint8_t  head[MAX_LANES], avail[MAX_LANES], live[MAX_LANES];
+    int      len[MAX_LANES], attempts[MAX_LANES], restarts[MAX_LANES];
+    uint8_t  letters[MAX_LANES][256];
+    int      rows[2][MAX_LANES], picks[2][MAX_LANES];
+    int      done[MAX_LANES];
+};
+
+// Starts lane l on the next name, if there is one left in the block
+static int begin_lane(struct lanes *s, int l, uint64_t *next, uint64_t end) {
+    s->ctr[0][l] = 0;
+    s->ctr[1][l] = (uint32_t)*next;
+    s->ctr[2][l] = (uint32_t)(*next >> 32);
+    s->head[l] = s->avail[l] = 0;
+    s->len[l] = s->attempts[l] = s->restarts[l] = 0;
+    s->live[l] = *next < end;
+    *next += s->live[l];
+    return s->live[l];
+}
+
+// Adds a finished name to w->names, name first+i going to offsets[i]
+static size_t keep_name(struct gen_worker *w, size_t used, const uint8_t *letters, int length, uint64_t i,
+                        int restarts) {
+    struct ltrgen *gen = &w->gen;
+    if (w->names_cap - used < (size_t)length + 1) {
+        w->names_cap = w->names_cap ? 2 * w->names_cap : GEN_BLOCK * 16;
+        if (!(w->names = realloc(w->names, w->names_cap)))
+            die("Unable to allocate %zu bytes for names", w->names_cap);
+    }
+    char *name = w->names + used;
+    w->offsets[i] = used;
+    for (int j = 0; j < length; j++)
+        name[j] = gen->model->alphabet[letters[j]];
+    name[0] = toupper(name[0]);
+    name[length] = '\n';
+    if (gen->collect_stats) {
+        gen->stats.names++;
+        gen->stats.restarts += restarts;
+        gen->stats.lengths[length]++;
+    }
+    return used + length + 1;
+}
+
+// Copies the names kept so far to w->buf, in index order
+static void order_names(struct gen_worker *w, size_t used) {
+    if (w->cap < used) {
+        w->cap = used;
+        if (!(w->buf = realloc(w->buf, w->cap)))
+            die("Unable to allocate %zu bytes for names", w->cap);
+    }
+    w->size = 0;
+    for (int i = 0; i < w->count; i++) {
+        const char *name = w->names + w->offsets[i];
+        size_t length = (const char *)memchr(name, '\n', used - w->offsets[i]) - name + 1;
+        memcpy(w->buf + w->size, name, length);
+        w->size += length;
+    }
+}
+
+static void generate_lanes(struct gen_worker *w) {
+    struct ltrgen *gen = &w->gen;
+    const struct ltrmodel *model = gen->model;
+    const int n = model->ltr->header.num_letters, maxlen = sizeof(gen->namebuf) - 1;
+    struct lanes *s = w->lanes;
+    const uint64_t first = gen->rng.index, last = first + w->count;
+    uint64_t next = first;
+    size_t used = 0;
+    int active = 0;
+
+    if (!(w->offsets = realloc(w->offsets, (w->count + 1) * sizeof(*w->offsets))))
+        die("Unable to allocate memory for %d names", w->count);
+    for (int l = 0; l < s->num; l++)
+        active += begin_lane(s, l, &next, last);
+
+    while (active > 0) {
+        // A step takes up to 2 draws. Once a lane runs short, all lanes with
+        // room for them get their next 4; the others get them written past
+        // their draws, where they are overwritten before ever being read
+        int refill = 0;
+        for (int l = 0; l < s->num; l++)
+            refill |= s->avail[l] < 2;
+        if (refill) {
+            philox_lanes(s->key, s->ctr, s->num, s->out);
+            for (int l = 0; l < s->num; l++) {
+                const int take = s->avail[l] <= 4;
+                const int at = s->head[l] + (take ? s->avail[l] : 8);
+                for (int i = 0; i < 4; i++)
+                    s->draws[l][(at + i) & 15] = s->out[i][l];
+                s->avail[l] += 4 * take;
+                s->ctr[0][l] += take;
             }
         }
 
-        if (i == ltr->header.num_letters) {
-            if (--p - namebuf < 3 || ++attempts > 100)
-                goto again;
+        // The start row while a name has fewer than 3 letters, else the end and
+        // middle rows of its last two letters
+        for (int l = 0; l < s->num; l++) {
+            const int len = s->len[l];
+            const int a = s->letters[l][(len - 2) & 255], b = s->letters[l][(len - 1) & 255];
+            const int start = len == 0 ? SINGLE_ROW(ROW_START) : len == 1 ? DOUBLE_ROW(b, ROW_START) : TRIPLE_ROW(a, b, ROW_START);
+            s->rows[0][l] = len >= 3 ? TRIPLE_ROW(a, b, ROW_END) : start;
+            s->rows[1][l] = TRIPLE_ROW(a, b, ROW_MIDDLE);
+        }
+        for (int l = 0; l < s->num; l++) {
+            const int r = s->draws[l][s->head[l]] >> 1;
+            s->picks[0][l] = pick(model, s->rows[0][l], r);
+            s->picks[1][l] = pick(model, s->rows[1][l], r);
+        }
+
+        int num_done = 0;
+        for (int l = 0; l < s->num; l++) {
+            const int len = s->len[l], e = s->picks[0][l], m = s->picks[1][l];
+            const int loop = len >= 3;
+            const int t = s->draws[l][(s->head[l] + 1) & 15] >> 1;
+            s->head[l] = (s->head[l] + 1 + loop) & 15;
+            s->avail[l] -= 1 + loop;
+
+            const int end = loop & (e != n) & (((t % 12) <= len) | (model->force_end & (m == n)));
+            const int back = loop & !end & (m == n);
+            const int shortfall = back & (len - 1 < 3);
+            const int attempts = s->attempts[l] + (back & !shortfall);
+            const int abort = back & !shortfall & (attempts > 100);
+            const int grow = (!loop & (e != n)) | end | (loop & !end & (m != n) & (len + 1 < maxlen));
+            const int restart = (!loop & (e == n)) | shortfall | abort | (loop & !end & (m != n) & !grow);
+
+            s->letters[l][len] = (loop & !end) ? m : e;
+            s->len[l] = restart ? 0 : len + grow - back;
+            s->attempts[l] = restart ? 0 : attempts;
+            s->restarts[l] += restart;
+            s->done[num_done] = l;
+            num_done += end & s->live[l];
+            if (gen->collect_stats) {
+                gen->stats.draws += (1 + loop) * s->live[l];
+                gen->stats.backtracks += back * s->live[l];
+                gen->stats.aborts += abort * s->live[l];
+            }
+        }
+
+        // Keep the finished names, and start the lanes on the next ones
+        for (int d = 0; d < num_done; d++) {
+            const int l = s->done[d];
+            const uint64_t index = (uint64_t)s->ctr[2][l] << 32 | s->ctr[1][l];
+            used = keep_name(w, used, s->letters[l], s->len[l], index - first, s->restarts[l]);
+            active -= !begin_lane(s, l, &next, last);
+        }
+    }
+    gen->rng.index = next;
+    order_names(w, used);
+}
+
+#ifdef HAVE_X86_KERNELS
+// The AVX2 version of generate_lanes() keeps the lanes in vectors, 8 lanes to
+// a group, and makes the whole step with vector ops. The draws of a lane are
+// selected from its current Philox block and the next one, which is only
+// computed once a lane may need it. With alias tables, the picks are gathers
+// too; otherwise every lane scans its own row.
+struct lane_group {
+    __m256i len, a, b, attempts, restarts, live;
+    __m256i pos, block, lo, hi, stale;  // draw pos of block, name index, next block not computed yet
+    __m256i cur[4], nxt[4];
+};
+
+#define BLENDV(x, y, mask) _mm256_castps_si256(_mm256_blendv_ps(_mm256_castsi256_ps(x), _mm256_castsi256_ps(y), _mm256_castsi256_ps(mask)))
+
+// Draw number pos (0 to 7) of the current and the next block of every lane
+__attribute__((target("avx2"), always_inline))
+static inline __m256i lane_draw(const struct lane_group *g, __m256i pos) {
+    const __m256i b0 = _mm256_slli_epi32(pos, 31), b1 = _mm256_slli_epi32(pos, 30), b2 = _mm256_slli_epi32(pos, 29);
+    const __m256i c = BLENDV(BLENDV(g->cur[0], g->cur[1], b0), BLENDV(g->cur[2], g->cur[3], b0), b1);
+    const __m256i x = BLENDV(BLENDV(g->nxt[0], g->nxt[1], b0), BLENDV(g->nxt[2], g->nxt[3], b0), b1);
+    return _mm256_srli_epi32(BLENDV(c, x, b2), 1);
+}
+
+// Picks from row with r, for every lane, like pick() does
+__attribute__((target("avx2"), always_inline))
+static inline __m256i lane_pick(const struct ltrmodel *model, __m256i row, __m256i r, __m256i none) {
+    if (model->alias) {
+        const struct alias_data *alias = model->alias;
+        const __m256i idx = _mm256_i32gather_epi32(alias->rowidx, row, 4);
+        const __m256i at = _mm256_mullo_epi32(_mm256_max_epi32(idx, _mm256_setzero_si256()),
+                                              _mm256_set1_epi32(sizeof(struct alias_row)));
+        // col and the low 31 bits of r * (NUM_LETTERS + 1)
+        const __m256i m = _mm256_set1_epi32(NUM_LETTERS + 1);
+        const __m256i xe = _mm256_mul_epu32(r, m), xo = _mm256_mul_epu32(_mm256_srli_epi64(r, 32), m);
+        const __m256i col = _mm256_blend_epi32(_mm256_srli_epi64(xe, 31), _mm256_slli_epi64(_mm256_srli_epi64(xo, 31), 32), 0xAA);
+        const __m256i low = _mm256_and_si256(_mm256_blend_epi32(xe, _mm256_slli_epi64(xo, 32), 0xAA), _mm256_set1_epi32(0x7fffffff));
+        const __m256i valid = _mm256_cmpgt_epi32(idx, _mm256_set1_epi32(-1)), zero = _mm256_setzero_si256();
+        const __m256i cut = _mm256_mask_i32gather_epi32(zero, (const int *)alias->rows[0].cut,
+                                                        _mm256_add_epi32(at, _mm256_slli_epi32(col, 2)), valid, 1);
+        const __m256i other = _mm256_and_si256(_mm256_mask_i32gather_epi32(zero, (const int *)alias->rows[0].alias,
+                                                                           _mm256_add_epi32(at, col), valid, 1),
+                                               _mm256_set1_epi32(0xff));
+        const __m256i sign = _mm256_set1_epi32(INT32_MIN);
+        const __m256i keep = _mm256_cmpgt_epi32(_mm256_xor_si256(cut, sign), _mm256_xor_si256(low, sign));
+        return BLENDV(none, BLENDV(other, col, keep), valid);
+    }
+
+    int32_t rows[8], rs[8], out[8];
+    _mm256_storeu_si256((__m256i *)rows, row);
+    _mm256_storeu_si256((__m256i *)rs, r);
+    for (int l = 0; l < 8; l++)
+        out[l] = pick(model, rows[l], rs[l]);
+    return _mm256_loadu_si256((const __m256i *)out);
+}
+
+// Starts the lanes of group g set in mask on the next names, if there are any
+// left in the block, and returns how many lanes that parked
+__attribute__((target("avx2"), always_inline))
+static inline int begin_lanes(struct lane_group *g, int mask, uint64_t *next, uint64_t end) {
+    const __m256i zero = _mm256_setzero_si256(), lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i m = _mm256_sub_epi32(zero, _mm256_and_si256(_mm256_srlv_epi32(_mm256_set1_epi32(mask), lanes),
+                                                              _mm256_set1_epi32(1)));
+    // Lane l gets name next + the number of lanes below it in mask
+    __m256i rank = _mm256_srli_epi32(m, 31);
+    for (int k = 1; k < 8; k *= 2) {
+        const __m256i from = _mm256_max_epi32(_mm256_sub_epi32(lanes, _mm256_set1_epi32(k)), zero);
+        const __m256i below = _mm256_and_si256(_mm256_permutevar8x32_epi32(rank, from), _mm256_cmpgt_epi32(lanes, _mm256_set1_epi32(k - 1)));
+        rank = _mm256_add_epi32(rank, below);
+    }
+    rank = _mm256_add_epi32(rank, m);
+    const uint64_t left = end - *next;
+    const int count = __builtin_popcount(mask), started = (uint64_t)count < left ? count : (int)left;
+    const __m256i lo = _mm256_add_epi32(_mm256_set1_epi32((uint32_t)*next), rank);
+    const __m256i carry = _mm256_cmpgt_epi32(_mm256_xor_si256(rank, _mm256_set1_epi32(INT32_MIN)),
+                                             _mm256_xor_si256(lo, _mm256_set1_epi32(INT32_MIN)));
+    g->lo = BLENDV(g->lo, lo, m);
+    g->hi = BLENDV(g->hi, _mm256_sub_epi32(_mm256_set1_epi32((uint32_t)(*next >> 32)), carry), m);
+    g->live = BLENDV(g->live, _mm256_cmpgt_epi32(_mm256_set1_epi32(started), rank), m);
+    *next += started;
+
+    g->len = _mm256_andnot_si256(m, g->len);
+    g->a = _mm256_andnot_si256(m, g->a);
+    g->b = _mm256_andnot_si256(m, g->b);
+    g->attempts = _mm256_andnot_si256(m, g->attempts);
+    g->restarts = _mm256_andnot_si256(m, g->restarts);
+    // Block -1 with its draws used up, so the first step moves on to block 0
+    g->block = _mm256_or_si256(m, g->block);
+    g->pos = BLENDV(g->pos, _mm256_set1_epi32(4), m);
+    g->stale = _mm256_or_si256(g->stale, m);
+    return count - started;
+}
+
+// One step of all groups at a time, each phase done for every group before the
+// next, so that the Philox rounds and the gathers of the groups overlap
+__attribute__((target("avx2"), always_inline))
+static inline void lanes_avx2(struct gen_worker *w, const int groups) {
+    struct ltrgen *gen = &w->gen;
+    const struct ltrmodel *model = gen->model;
+    struct lanes *s = w->lanes;
+    const uint64_t first = gen->rng.index, last = first + w->count;
+    uint64_t next = first;
+    size_t used = 0;
+    int active = 8 * groups;
+    struct lane_group g[MAX_LANES / 8];
+
+    const __m256i zero = _mm256_setzero_si256(), one = _mm256_set1_epi32(1), two = _mm256_set1_epi32(2);
+    const __m256i three = _mm256_set1_epi32(3), four = _mm256_set1_epi32(4), ones = _mm256_set1_epi32(-1);
+    const __m256i none = _mm256_set1_epi32(model->ltr->header.num_letters);
+    const __m256i maxlen = _mm256_set1_epi32(sizeof(gen->namebuf) - 1);
+    const __m256i force_end = _mm256_set1_epi32(-(model->force_end != 0));
+    const __m256i lanes = _mm256_setr_epi32(0, 256, 512, 768, 1024, 1280, 1536, 1792);
+
+    if (!(w->offsets = realloc(w->offsets, (w->count + 1) * sizeof(*w->offsets))))
+        die("Unable to allocate memory for %d names", w->count);
+    memset(g, 0, sizeof(g));
+    for (int i = 0; i < groups; i++)
+        active -= begin_lanes(&g[i], 0xff, &next, last);
+
+    while (active > 0) {
+        // Compute the next blocks once a lane may need one, then move on to
+        // them where the current ones are used up
+        int need = 0;
+        for (int i = 0; i < groups; i++) {
+            const __m256i x = _mm256_and_si256(g[i].stale, _mm256_cmpgt_epi32(g[i].pos, two));
+            need |= !_mm256_testz_si256(x, x);
+        }
+        if (need) {
+            __m256i c0[MAX_LANES / 8], c1[MAX_LANES / 8], c2[MAX_LANES / 8], nxt[MAX_LANES / 8][4];
+            for (int i = 0; i < groups; i++) {
+                c0[i] = _mm256_add_epi32(g[i].block, one);
+                c1[i] = g[i].lo;
+                c2[i] = g[i].hi;
+            }
+            philox8(s->key, groups, c0, c1, c2, nxt);
+            for (int i = 0; i < groups; i++) {
+                for (int k = 0; k < 4; k++)
+                    g[i].nxt[k] = BLENDV(g[i].nxt[k], nxt[i][k], g[i].stale);
+                g[i].stale = zero;
+            }
+        }
+
+        __m256i len[MAX_LANES / 8], loop[MAX_LANES / 8], e[MAX_LANES / 8], m[MAX_LANES / 8], t[MAX_LANES / 8];
+        for (int i = 0; i < groups; i++) {
+            struct lane_group *G = &g[i];
+            const __m256i shift = _mm256_cmpgt_epi32(G->pos, three);
+            for (int k = 0; k < 4; k++)
+                G->cur[k] = BLENDV(G->cur[k], G->nxt[k], shift);
+            G->pos = _mm256_sub_epi32(G->pos, _mm256_and_si256(shift, four));
+            G->block = _mm256_sub_epi32(G->block, shift);
+            G->stale = _mm256_or_si256(G->stale, shift);
+
+            // Rows, as in generate_lanes()
+            len[i] = G->len;
+            loop[i] = _mm256_cmpgt_epi32(len[i], two);
+            const __m256i pair = _mm256_add_epi32(_mm256_mullo_epi32(G->a, _mm256_set1_epi32(NUM_LETTERS)), G->b);
+            const __m256i triple = _mm256_mullo_epi32(_mm256_add_epi32(pair, _mm256_set1_epi32(1 + NUM_LETTERS)), three);
+            __m256i start = BLENDV(_mm256_mullo_epi32(_mm256_add_epi32(G->b, one), three), triple, _mm256_cmpeq_epi32(len[i], two));
+            start = BLENDV(start, _mm256_set1_epi32(SINGLE_ROW(ROW_START)), _mm256_cmpeq_epi32(len[i], zero));
+            const __m256i erow = BLENDV(start, _mm256_add_epi32(triple, _mm256_set1_epi32(ROW_END)), loop[i]);
+            const __m256i mrow = _mm256_add_epi32(triple, _mm256_set1_epi32(ROW_MIDDLE));
+
+            const __m256i r = lane_draw(G, G->pos);
+            t[i] = lane_draw(G, _mm256_add_epi32(G->pos, one));
+            e[i] = lane_pick(model, erow, r, none);
+            m[i] = lane_pick(model, mrow, r, none);
+        }
+
+        for (int i = 0; i < groups; i++) {
+            struct lane_group *G = &g[i];
+            uint8_t (*letters)[256] = &s->letters[8 * i];
+
+            // t % 12, as t * 0xAAAAAAAB >> 35 is t / 12 for any 32 bit t
+            const __m256i q12 = _mm256_set1_epi32(0xAAAAAAAB);
+            const __m256i qe = _mm256_srli_epi64(_mm256_mul_epu32(t[i], q12), 35);
+            const __m256i qo = _mm256_srli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(t[i], 32), q12), 35);
+            const __m256i q = _mm256_blend_epi32(qe, _mm256_slli_epi64(qo, 32), 0xAA);
+            const __m256i rem = _mm256_sub_epi32(t[i], _mm256_mullo_epi32(q, _mm256_set1_epi32(12)));
+
+            // The update of generate_lanes(), with masks
+            const __m256i eok = _mm256_xor_si256(_mm256_cmpeq_epi32(e[i], none), ones);
+            const __m256i mmiss = _mm256_cmpeq_epi32(m[i], none);
+            const __m256i endtest = _mm256_xor_si256(_mm256_cmpgt_epi32(rem, len[i]), ones);
+            const __m256i end = _mm256_and_si256(_mm256_and_si256(loop[i], eok),
+                                                 _mm256_or_si256(endtest, _mm256_and_si256(force_end, mmiss)));
+            const __m256i more = _mm256_andnot_si256(end, loop[i]);
+            const __m256i back = _mm256_and_si256(more, mmiss);
+            const __m256i shortfall = _mm256_and_si256(back, _mm256_cmpgt_epi32(four, len[i]));
+            const __m256i counted = _mm256_andnot_si256(shortfall, back);
+            const __m256i attempts = _mm256_sub_epi32(G->attempts, counted);
+            const __m256i abort = _mm256_and_si256(counted, _mm256_cmpgt_epi32(attempts, _mm256_set1_epi32(100)));
+            const __m256i middle = _mm256_andnot_si256(mmiss, more);
+            const __m256i room = _mm256_cmpgt_epi32(maxlen, _mm256_add_epi32(len[i], one));
+            const __m256i grow = _mm256_or_si256(_mm256_or_si256(_mm256_andnot_si256(loop[i], eok), end),
+                                                 _mm256_and_si256(middle, room));
+            const __m256i restart = _mm256_or_si256(_mm256_or_si256(_mm256_andnot_si256(_mm256_or_si256(loop[i], eok), ones),
+                                                                    _mm256_or_si256(shortfall, abort)),
+                                                    _mm256_andnot_si256(room, middle));
+            const __m256i c = BLENDV(e[i], m[i], more);
+
+            int32_t cs[8], ls[8];
+            _mm256_storeu_si256((__m256i *)cs, c);
+            _mm256_storeu_si256((__m256i *)ls, len[i]);
+            for (int l = 0; l < 8; l++)
+                letters[l][ls[l]] = cs[l];
+            // Backing off, the new second last letter is 3 back from len
+            __m256i older = zero;
+            if (!_mm256_testz_si256(back, back)) {
+                const __m256i back3 = _mm256_add_epi32(lanes, _mm256_max_epi32(_mm256_sub_epi32(len[i], three), zero));
+                older = _mm256_and_si256(_mm256_i32gather_epi32((const int *)letters, back3, 1), _mm256_set1_epi32(0xff));
+            }
+
+            const __m256i a = G->a, b = G->b;
+            G->len = _mm256_andnot_si256(restart, _mm256_add_epi32(_mm256_sub_epi32(len[i], grow), back));
+            G->a = _mm256_andnot_si256(restart, BLENDV(BLENDV(a, b, grow), older, back));
+            G->b = _mm256_andnot_si256(restart, BLENDV(BLENDV(b, c, grow), a, back));
+            G->attempts = _mm256_andnot_si256(restart, attempts);
+            G->restarts = _mm256_sub_epi32(G->restarts, restart);
+            G->pos = _mm256_add_epi32(G->pos, _mm256_sub_epi32(one, loop[i]));
+            if (gen->collect_stats) {
+                const int live = _mm256_movemask_ps(_mm256_castsi256_ps(G->live));
+                gen->stats.draws += __builtin_popcount(live) + __builtin_popcount(live & _mm256_movemask_ps(_mm256_castsi256_ps(loop[i])));
+                gen->stats.backtracks += __builtin_popcount(live & _mm256_movemask_ps(_mm256_castsi256_ps(back)));
+                gen->stats.aborts += __builtin_popcount(live & _mm256_movemask_ps(_mm256_castsi256_ps(abort)));
+            }
+
+            // Keep the finished names, and start the lanes on the next ones
+            const int done = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_and_si256(end, G->live)));
+            if (done) {
+                int32_t lo[8], hi[8], restarts[8];
+                _mm256_storeu_si256((__m256i *)ls, G->len);
+                _mm256_storeu_si256((__m256i *)lo, G->lo);
+                _mm256_storeu_si256((__m256i *)hi, G->hi);
+                _mm256_storeu_si256((__m256i *)restarts, G->restarts);
+                for (int l = 0; l < 8; l++) {
+                    if (!(done >> l & 1))
+                        continue;
+                    const uint64_t index = (uint64_t)(uint32_t)hi[l] << 32 | (uint32_t)lo[l];
+                    used = keep_name(w, used, letters[l], ls[l], index - first, restarts[l]);
+                }
+                active -= begin_lanes(G, done, &next, last);
+            }
+        }
+    }
+    gen->rng.index = next;
+    order_names(w, used);
+}
+
+__attribute__((target("avx2")))
+static void generate_lanes_avx2(struct gen_worker *w) {
+    if (w->lanes->num == 16)
+        lanes_avx2(w, 2);
+    else
+        lanes_avx2(w, 1);
+}
+#undef BLENDV
+#endif
+
+static void *generate_block(void *arg) {
+    struct gen_worker *w = arg;
+    if (w->lanes) {
+#ifdef HAVE_X86_KERNELS
+        if (philox_lanes == philox_lanes_avx2) {
+            generate_lanes_avx2(w);
+            return NULL;
+        }
+#endif
+        generate_lanes(w);
+        return NULL;
+    }
+    w->size = 0;
+    for (int i = 0; i < w->count; i++) {
+        if (w->cap - w->size < sizeof(w->gen.namebuf) + 1) {
+            w->cap = w->cap ? 2 * w->cap : GEN_BLOCK * 16;
+            if (!(w->buf = realloc(w->buf, w->cap)))
+                die("Unable to allocate %zu bytes for names", w->cap);
+        }
+        w->size += random_name_r(&w->gen, w->buf + w->size, sizeof(w->gen.namebuf));
+        w->buf[w->size++] = '\n';
+    }
+    return NULL;
+}
+
+void generate_names(const struct ltrmodel *model, uint32_t seed, int counter, uint64_t index, int count, int threads,
+                    int lanes, struct genstats *stats) {
+    struct gen_worker *workers = calloc(threads, sizeof(*workers));
+    if (!workers)
+        die("Unable to allocate %d workers", threads);
+    for (int t = 0; t < threads; t++) {
+        init_gen(&workers[t].gen, model, stream_seed(seed, t));
+        workers[t].gen.collect_stats = stats != NULL;
+        if (counter || lanes)
+            seed_counter_rng(&workers[t].gen.rng, seed, 0);
+        if (lanes) {
+            if (!(workers[t].lanes = calloc(1, sizeof(*workers[t].lanes))))
+                die("Unable to allocate memory for %d lanes", lanes);
+            workers[t].lanes->num = lanes;
+            memcpy(workers[t].lanes->key, workers[t].gen.rng.key, sizeof(workers[t].lanes->key));
+        }
+    }
+
+    while (count > 0) {
+        for (int t = 0; t < threads; t++) {
+            workers[t].count = count < GEN_BLOCK ? count : GEN_BLOCK;
+            workers[t].gen.rng.index = index;
+            index += workers[t].count;
+            count -= workers[t].count;
+            if (t > 0 && pthread_create(&workers[t].thread, NULL, generate_block, &workers[t]))
+                die("Unable to create thread");
+        }
+        generate_block(&workers[0]);
+        for (int t = 0; t < threads; t++) {
+            if (t > 0)
+                pthread_join(workers[t].thread, NULL);
+            if (workers[t].size)
+                fwrite(workers[t].buf, 1, workers[t].size, stdout);
+        }
+    }
+
+    for (int t = 0; t < threads; t++) {
+        if (stats)
+            add_stats(stats, &workers[t].gen.stats);
+        free(workers[t].buf);
+        free(workers[t].lanes);
+        free(workers[t].names);
+        free(workers[t].offsets);
+    }
+    free(workers);
+}
+
+// Best first search for the most probable names. Every node is a finished name
+// with its chance, or a name so far with the chance of the generator giving
+// any name that starts with it, which is what the node's steps share out. So
+// the best node left is finished only if no other name can beat it anymore.
+// Chances are those of name_step(), i.e. of generate_name(), backoff included.
+struct enum_node {
+    double   p;
+    uint32_t parent;
+    uint8_t  prev, letter, len, ended;
+};
+struct enum_search {
+    struct enum_node *nodes;
+    uint32_t         *heap;
+    size_t            num_nodes, heap_size, max_nodes;
+};
+
+static int enum_add(struct enum_search *e, double p, uint32_t parent, int prev, int letter, int len, int ended,
+                    int push) {
+    if (e->num_nodes == e->max_nodes)
+        return 0;
+    uint32_t id = e->num_nodes++;
+    e->nodes[id] = (struct enum_node){ p, parent, prev, letter, len, ended };
+    if (push) {
+        size_t i = e->heap_size++;
+        for (; i > 0 && e->nodes[e->heap[(i - 1) / 2]].p < p; i = (i - 1) / 2)
+            e->heap[i] = e->heap[(i - 1) / 2];
+        e->heap[i] = id;
+    }
+    return 1;
+}
+
+static uint32_t enum_pop(struct enum_search *e) {
+    uint32_t top = e->heap[0], last = e->heap[--e->heap_size];
+    size_t i = 0;
+    for (size_t c; (c = 2 * i + 1) < e->heap_size; i = c) {
+        if (c + 1 < e->heap_size && e->nodes[e->heap[c + 1]].p > e->nodes[e->heap[c]].p)
+            c++;
+        if (e->nodes[e->heap[c]].p <= e->nodes[last].p)
+            break;
+        e->heap[i] = e->heap[c];
+    }
+    e->heap[i] = last;
+    return top;
+}
+
+void enumerate_names(const struct ltrmodel *model, int count, size_t max_mem) {
+    const int n = model->ltr->header.num_letters;
+    const struct ltrdata *d = &model->ltr->data;
+    struct enum_search e = { 0 };
+    e.max_nodes = max_mem / (sizeof(struct enum_node) + sizeof(uint32_t));
+    if (e.max_nodes > UINT32_MAX)
+        e.max_nodes = UINT32_MAX;
+    if (!(e.nodes = malloc(e.max_nodes * sizeof(*e.nodes))) || !(e.heap = malloc(e.max_nodes * sizeof(*e.heap))))
+        die("Unable to allocate %zu MB for the search", max_mem >> 20);
+
+    struct backoff *bo = new_backoff(model);
+    if (!(bo->success > 0.0))
+        die("No name can be completed from this table");
+    double p1[NUM_LETTERS], p2[NUM_LETTERS], p3[NUM_LETTERS];
+    int full = 0;
+    row_pdf(d->singles.start, n, p1);
+    for (int a = 0; a < n && !full; a++) {
+        if (p1[a] <= 0.0)
+            continue;
+        uint32_t na = e.num_nodes;
+        full = !enum_add(&e, p1[a], 0, 0, a, 1, 0, 0);
+        row_pdf(d->doubles[a].start, n, p2);
+        for (int b = 0; b < n && !full; b++) {
+            if (p2[b] <= 0.0)
+                continue;
+            uint32_t nb = e.num_nodes;
+            full = !enum_add(&e, p1[a] * p2[b], na, a, b, 2, 0, 0);
+            row_pdf(d->triples[a][b].start, n, p3);
+            for (int c = 0; c < n && !full; c++) {
+                const double p = p1[a] * p2[b] * p3[c] * bo->done[3][b][c] / bo->success;
+                if (p > 0.0)
+                    full = !enum_add(&e, p, nb, b, c, 3, 0, 1);
+            }
+        }
+    }
+
+    int found = 0;
+    double covered = 0.0;
+    while (found < count && e.heap_size > 0 && !full) {
+        uint32_t id = enum_pop(&e);
+        const struct enum_node node = e.nodes[id];
+        if (node.ended) {
+            char name[256];
+            uint32_t at = id;
+            for (int i = node.len - 1; i >= 0; i--, at = e.nodes[at].parent)
+                name[i] = model->alphabet[e.nodes[at].letter];
+            name[0] = toupper(name[0]);
+            name[node.len] = '\0';
+            printf("%s\t%.6g\n", name, node.p);
+            covered += node.p;
+            found++;
+            continue;
+        }
+
+        // The chance of reaching the node, of which it finishes done
+        const double reach = node.p / bo->done[node.len][node.prev][node.letter];
+        double end[NUM_LETTERS], middle[NUM_LETTERS];
+        name_step(model, bo, node.prev, node.letter, node.len, end, middle);
+        for (int i = 0; i < n && !full; i++) {
+            const double go = reach * middle[i] * bo->done[node.len + 1][node.letter][i];
+            if (end[i] > 0.0)
+                full = !enum_add(&e, reach * end[i], id, node.letter, i, node.len + 1, 1, 1);
+            if (go > 0.0)
+                full = full || !enum_add(&e, go, id, node.letter, i, node.len + 1, 0, 1);
+        }
+    }
+
+    if (full)
+        fprintf(stderr, "Stopped after %d names: the search needs more than %zu MB, see --enum-mem\n", found,
+                max_mem >> 20);
+    fprintf(stderr, "The %d names cover %.4f%% of the probability, the search used %zu nodes\n", found,
+            100.0 * covered, e.num_nodes);
+    free(bo);
+    free(e.nodes);
+    free(e.heap);
+}
+
+// Log probability of names under the same model as name_step(). Everything
+// is precomputed into flat log tables, with the end test chance cut into the
+// 9 buckets it can take (names of 3 to 11 letters and longer) and the backoff
+// fold kept apart per length, so scoring a name is two table lookups per
+// letter. Input is split into newline aligned
+// chunks scored on all threads, and the output is written in input order.
+#define SCORE_BUCKETS 9
+#define SCORE_CHUNK   (4 << 20)
+struct score_tables {
+    float  start1[NUM_LETTERS];
+    float  start2[NUM_LETTERS][NUM_LETTERS];
+    float  start3[NUM_LETTERS][NUM_LETTERS][NUM_LETTERS];
+    float  end   [SCORE_BUCKETS][NUM_LETTERS][NUM_LETTERS][NUM_LETTERS];
+    float  middle[SCORE_BUCKETS][NUM_LETTERS][NUM_LETTERS][NUM_LETTERS];
+    float  fold[256][NUM_LETTERS][NUM_LETTERS];
+    int8_t ix[256];
+};
+
+struct score_worker {
+    pthread_t                  thread;
+    const struct score_tables *tables;
+    const struct class_tables *classes; // with --classify instead of tables
+    int                        top;
+    const char                *begin, *end;
+    char                      *buf;
+    size_t                     size, cap;
+};
+
+static float logf_or_inf(double p) {
+    return p > 0.0 ? (float)log(p) : -INFINITY;
+}
+
+static struct score_tables *new_score_tables(const struct ltrmodel *model) {
+    const int n = model->ltr->header.num_letters;
+    const struct ltrdata *d = &model->ltr->data;
+    struct score_tables *t = malloc(sizeof(*t));
+    if (!t)
+        die("Unable to allocate memory for the score tables");
+    struct backoff *bo = new_backoff(model);
+    double p1[NUM_LETTERS], p2[NUM_LETTERS], p3[NUM_LETTERS], end[NUM_LETTERS], middle[NUM_LETTERS];
+    row_pdf(d->singles.start, n, p1);
+    for (int a = 0; a < n; a++) {
+        t->start1[a] = logf_or_inf(p1[a] / bo->success);
+        row_pdf(d->doubles[a].start, n, p2);
+        for (int b = 0; b < n; b++) {
+            t->start2[a][b] = logf_or_inf(p2[b]);
+            row_pdf(d->triples[a][b].start, n, p3);
+            for (int c = 0; c < n; c++)
+                t->start3[a][b][c] = logf_or_inf(p3[c]);
+            for (int q = 0; q < SCORE_BUCKETS; q++) {
+                step_probs(model, a, b, q + 3, end, middle);
+                for (int c = 0; c < n; c++) {
+                    t->end[q][a][b][c] = logf_or_inf(end[c]);
+                    t->middle[q][a][b][c] = logf_or_inf(middle[c]);
+                }
+            }
+            for (int L = 0; L < 256; L++)
+                t->fold[L][a][b] = logf_or_inf(bo->fold[L][a][b]);
+        }
+    }
+    free(bo);
+    memset(t->ix, -1, sizeof(t->ix));
+    for (int i = 0; i < model->num_letters; i++) {
+        t->ix[(uint8_t)model->alphabet[i]] = i;
+        t->ix[(uint8_t)toupper(model->alphabet[i])] = i;
+    }
+    return t;
+}
+
+static double score_name(const struct score_tables *t, const char *s, int len) {
+    uint8_t x[256];
+    if (len < 4 || len > 255)
+        return -INFINITY;
+    for (int i = 0; i < len; i++) {
+        int8_t c = t->ix[(uint8_t)s[i]];
+        if (c < 0)
+            return -INFINITY;
+        x[i] = c;
+    }
+    double lp = t->start1[x[0]] + t->start2[x[0]][x[1]] + t->start3[x[0]][x[1]][x[2]];
+    for (int k = 3; k < len - 1; k++)
+        lp += t->middle[k < 11 ? k - 3 : 8][x[k - 2]][x[k - 1]][x[k]] + t->fold[k][x[k - 2]][x[k - 1]];
+    int k = len - 1;
+    return lp + t->end[k < 11 ? k - 3 : 8][x[k - 2]][x[k - 1]][x[k]] + t->fold[k][x[k - 2]][x[k - 1]];
+}
+
+// Writes lp with 4 decimals, much faster than printf
+static char *format_logp(char *out, double lp) {
+    if (!(lp > -1e15)) {
+        memcpy(out, "-inf", 4);
+        return out + 4;
+    }
+    uint64_t v = (uint64_t)((lp < 0.0 ? -lp : lp) * 10000.0 + 0.5);
+    char digits[24];
+    int len = 0;
+    do {
+        digits[len++] = '0' + v % 10;
+        v /= 10;
+    } while (v || len < 5);
+    if (lp < 0.0)
+        *out++ = '-';
+    while (len > 4)
+        *out++ = digits[--len];
+    *out++ = '.';
+    while (len > 0)
+        *out++ = digits[--len];
+    return out;
+}
+
+// Multi-table classification. The log tables of all tables are interleaved
+// table-minor: the entries every table has for the same letters sit next to
+// each other, so scoring a name against all tables reads one short run per
+// letter, and the adds over the tables vectorize.
+struct class_tables {
+    int     num_tables;
+    char  (*names)[64];
+    float  *start1, *start2, *start3, *end, *middle, *fold;
+    int8_t  ix[256];
+};
+
+static size_t class_index(int q, int a, int b, int c) {
+    return ((size_t)(q * NUM_LETTERS + a) * NUM_LETTERS + b) * NUM_LETTERS + c;
+}
+
+static struct class_tables *new_class_tables(char **files, int num_files, int nofix, int smooth, double k) {
+    const int T = num_files;
+    struct class_tables *ct = calloc(1, sizeof(*ct));
+    const size_t N3 = NUM_LETTERS * NUM_LETTERS * NUM_LETTERS;
+    if (!ct || !(ct->names = calloc(T, sizeof(*ct->names))) ||
+        !(ct->start1 = malloc(NUM_LETTERS * T * sizeof(float))) ||
+        !(ct->start2 = malloc(NUM_LETTERS * NUM_LETTERS * T * sizeof(float))) ||
+        !(ct->start3 = malloc(N3 * T * sizeof(float))) ||
+        !(ct->end = malloc(SCORE_BUCKETS * N3 * T * sizeof(float))) ||
+        !(ct->middle = malloc(SCORE_BUCKETS * N3 * T * sizeof(float))) ||
+        !(ct->fold = malloc(256 * NUM_LETTERS * NUM_LETTERS * T * sizeof(float))))
+        die("Unable to allocate memory for %d tables", T);
+    ct->num_tables = T;
+
+    char alphabet[NUM_LETTERS + 1];
+    for (int t = 0; t < T; t++) {
+        struct ltrmodel model;
+        open_model(files[t], &model);
+        if (!nofix)
+            fix_ltr(model.ltr);
+        if (smooth)
+            smooth_ltr(&model, smooth, k);
+        if (t == 0)
+            strcpy(alphabet, model.alphabet);
+        else if (strcmp(alphabet, model.alphabet))
+            die("Can't classify with %s, its letters \"%s\" are not \"%s\"", files[t], model.alphabet, alphabet);
+
+        // Named after the file, or the table for BUNDLE:NAME
+        const char *colon = strrchr(files[t], ':');
+        const char *base = colon && access(files[t], F_OK) ? colon + 1
+                         : strrchr(files[t], '/') ? strrchr(files[t], '/') + 1 : files[t];
+        size_t len = strcspn(base, ".");
+        snprintf(ct->names[t], sizeof(ct->names[t]), "%.*s", (int)len, base);
+
+        struct score_tables *st = new_score_tables(&model);
+        memcpy(ct->ix, st->ix, sizeof(ct->ix));
+        for (int a = 0; a < NUM_LETTERS; a++) {
+            ct->start1[a * T + t] = st->start1[a];
+            for (int b = 0; b < NUM_LETTERS; b++) {
+                ct->start2[(a * NUM_LETTERS + b) * T + t] = st->start2[a][b];
+                for (int L = 0; L < 256; L++)
+                    ct->fold[((L * NUM_LETTERS + a) * NUM_LETTERS + b) * T + t] = st->fold[L][a][b];
+                for (int c = 0; c < NUM_LETTERS; c++) {
+                    ct->start3[class_index(0, a, b, c) * T + t] = st->start3[a][b][c];
+                    for (int q = 0; q < SCORE_BUCKETS; q++) {
+                        ct->end[class_index(q, a, b, c) * T + t] = st->end[q][a][b][c];
+                        ct->middle[class_index(q, a, b, c) * T + t] = st->middle[q][a][b][c];
+                    }
+                }
+            }
+        }
+        free(st);
+        close_model(&model);
+    }
+    return ct;
+}
+
+static void free_class_tables(struct class_tables *ct) {
+    free(ct->names);
+    free(ct->start1);
+    free(ct->start2);
+    free(ct->start3);
+    free(ct->end);
+    free(ct->middle);
+    free(ct->fold);
+    free(ct);
+}
+
+static void classify_name(const struct class_tables *ct, const char *s, int len, double *lp) {
+    const int T = ct->num_tables;
+    uint8_t x[256];
+    int ok = len >= 4 && len <= 255;
+    for (int i = 0; i < len && ok; i++)
+        ok = (x[i] = ct->ix[(uint8_t)s[i]]) < NUM_LETTERS;
+    if (!ok) {
+        for (int t = 0; t < T; t++)
+            lp[t] = -INFINITY;
+        return;
+    }
+
+    const float *s1 = ct->start1 + x[0] * T, *s2 = ct->start2 + (x[0] * NUM_LETTERS + x[1]) * T;
+    const float *s3 = ct->start3 + class_index(0, x[0], x[1], x[2]) * T;
+    for (int t = 0; t < T; t++)
+        lp[t] = s1[t] + s2[t] + s3[t];
+    for (int k = 3; k < len; k++) {
+        const float *row = (k < len - 1 ? ct->middle : ct->end) +
+                           class_index(k < 11 ? k - 3 : 8, x[k - 2], x[k - 1], x[k]) * T;
+        const float *fold = ct->fold + ((k * NUM_LETTERS + x[k - 2]) * NUM_LETTERS + x[k - 1]) * T;
+        for (int t = 0; t < T; t++)
+            lp[t] += row[t] + fold[t];
+    }
+}
+
+static void *score_chunk(void *arg) {
+    struct score_worker *w = arg;
+    const int T = w->classes ? w->classes->num_tables : 0;
+    double *lp = T ? malloc(T * sizeof(double)) : NULL;
+    uint8_t *used = T ? malloc(T) : NULL;
+    if (T && (!lp || !used))
+        die("Unable to allocate memory for scores");
+    w->size = 0;
+    for (const char *line = w->begin, *eol; line < w->end; line = eol + 1) {
+        if (!(eol = memchr(line, '\n', w->end - line)))
+            eol = w->end;
+        const char *s = line, *e = eol;
+        while (s < e && isspace((uint8_t)*s))
+            s++;
+        while (e > s && isspace((uint8_t)e[-1]))
+            e--;
+        if (s == e)
+            continue;
+        size_t need = (e - s) + 32 + (size_t)w->top * (sizeof(w->classes->names[0]) + 32);
+        if (w->cap - w->size < need) {
+            w->cap = 2 * w->cap + need;
+            if (!(w->buf = realloc(w->buf, w->cap)))
+                die("Unable to allocate %zu bytes for scores", w->cap);
+        }
+        char *out = w->buf + w->size;
+        memcpy(out, s, e - s);
+        out += e - s;
+        if (!T) {
+            *out++ = '\t';
+            out = format_logp(out, score_name(w->tables, s, e - s));
+        } else {
+            // The best w->top tables, best first
+            classify_name(w->classes, s, e - s, lp);
+            memset(used, 0, T);
+            for (int m = 0; m < w->top && m < T; m++) {
+                int best = -1;
+                for (int t = 0; t < T; t++)
+                    if (!used[t] && (best < 0 || lp[t] > lp[best]))
+                        best = t;
+                used[best] = 1;
+                out += sprintf(out, "\t%s:", w->classes->names[best]);
+                out = format_logp(out, lp[best]);
+            }
+        }
+        *out++ = '\n';
+        w->size = out - w->buf;
+    }
+    free(lp);
+    free(used);
+    return NULL;
+}
+
+// Runs score_chunk() over the files, or stdin if there are none
+static void score_input(struct score_worker *workers, int threads, char **files, int num_files) {
+    static char *stdin_file[] = { "/dev/stdin" };
+    if (num_files == 0) {
+        files = stdin_file;
+        num_files = 1;
+    }
+
+    for (int f = 0; f < num_files; f++) {
+        size_t size;
+        int mapped;
+        const char *buf = (const char *)read_file(files[f], &size, &mapped);
+        if (mapped)
+            madvise((void *)buf, size, MADV_SEQUENTIAL);
+        const char *at = buf, *end = buf + size;
+        while (at < end) {
+            for (int t = 0; t < threads; t++) {
+                const char *split = end;
+                if ((size_t)(end - at) > SCORE_CHUNK && !(split = memchr(at + SCORE_CHUNK, '\n', end - at - SCORE_CHUNK)))
+                    split = end;
+                workers[t].begin = at;
+                workers[t].end = at = split;
+                if (t > 0 && pthread_create(&workers[t].thread, NULL, score_chunk, &workers[t]))
+                    die("Unable to create thread");
+            }
+            score_chunk(&workers[0]);
+            for (int t = 0; t < threads; t++) {
+                if (t > 0)
+                    pthread_join(workers[t].thread, NULL);
+                if (workers[t].size)
+                    fwrite(workers[t].buf, 1, workers[t].size, stdout);
+            }
+        }
+        if (mapped)
+            munmap((void *)buf, size);
+        else
+            free((void *)buf);
+    }
+
+    for (int t = 0; t < threads; t++)
+        free(workers[t].buf);
+    free(workers);
+}
+
+// Prints every line of the files (or stdin) with the natural log of the
+// chance of generating it, -inf if it can't be generated
+void score_names(const struct ltrmodel *model, char **files, int num_files, int threads) {
+    struct score_tables *tables = new_score_tables(model);
+    struct score_worker *workers = calloc(threads, sizeof(*workers));
+    if (!workers)
+        die("Unable to allocate %d workers", threads);
+    for (int t = 0; t < threads; t++)
+        workers[t].tables = tables;
+    score_input(workers, threads, files, num_files);
+    free(tables);
+}
+
+// Prints every line of stdin with the top tables that most likely generated
+// it, and the log probabilities they give it
+void classify_names(char **tables, int num_tables, int top, int threads, int nofix, int smooth, double k) {
+    struct class_tables *ct = new_class_tables(tables, num_tables, nofix, smooth, k);
+    struct score_worker *workers = calloc(threads, sizeof(*workers));
+    if (!workers)
+        die("Unable to allocate %d workers", threads);
+    for (int t = 0; t < threads; t++) {
+        workers[t].classes = ct;
+        workers[t].top = top;
+    }
+    score_input(workers, threads, NULL, 0);
+    free_class_tables(ct);
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Times every supported kernel on random lookups into the non-empty rows of
+// a table, and checks that each one agrees with the scalar scan. With quant,
+// the quantized scans are timed instead, against the float scalar scan, which
+// the 32 bit ones must match and the 16 bit ones differ from by rounding.
+void bench_kernels(const char *filename, const struct ltrfile *ltr, const struct quant_data *quant) {
+    enum { PROBES = 1 << 18, PASSES = 32 };
+    int *rows = malloc(PROBES * sizeof(*rows));
+    int *draws = malloc(PROBES * sizeof(*draws));
+    int *expect = malloc(PROBES * sizeof(*expect));
+    int *nonempty = malloc(NUM_ROWS * sizeof(*nonempty));
+    int num_nonempty = 0;
+    if (!rows || !draws || !expect || !nonempty)
+        die("Unable to allocate benchmark probes");
+
+    for (int r = 0; r < NUM_ROWS; r++)
+        if (scan_scalar(ltr_row(&ltr->data, r), 0.0f) != NUM_LETTERS)
+            nonempty[num_nonempty++] = r;
+    if (num_nonempty == 0)
+        die("File %s has no non-empty rows", filename);
+
+    struct rng rng;
+    seed_rng(&rng, 1);
+    for (int i = 0; i < PROBES; i++) {
+        rows[i]   = nonempty[next_rng(&rng) % num_nonempty];
+        draws[i]  = next_rng(&rng);
+        expect[i] = scan_scalar(ltr_row(&ltr->data, rows[i]), (float)draws[i] / RNG_MAX);
+    }
+
+    double scalar_ns = 0.0;
+    for (int k = 0; k < NUM_KERNELS; k++) {
+        if (!kernels[k].supported())
+            continue;
+
+        volatile int sink = 0;
+        double start = now();
+        for (int pass = 0; pass < PASSES; pass++) {
+            if (!quant)
+                for (int i = 0; i < PROBES; i++)
+                    sink += kernels[k].scan(ltr_row(&ltr->data, rows[i]), (float)draws[i] / RNG_MAX);
+            else if (quant->bits == 16)
+                for (int i = 0; i < PROBES; i++)
+                    sink += kernels[k].scan_q16(quant->q16 + rows[i] * NUM_LETTERS, draws[i]);
+            else
+                for (int i = 0; i < PROBES; i++)
+                    sink += kernels[k].scan_q32(quant->q32 + rows[i] * NUM_LETTERS, draws[i]);
         }
+        double ns = (now() - start) * 1e9 / ((double)PROBES * PASSES);
+        (void)sink;
+
+        int mismatches = 0;
+        for (int i = 0; i < PROBES; i++) {
+            int got = !quant ? kernels[k].scan(ltr_row(&ltr->data, rows[i]), (float)draws[i] / RNG_MAX)
+                    : quant->bits == 16 ? kernels[k].scan_q16(quant->q16 + rows[i] * NUM_LETTERS, draws[i])
+                    : kernels[k].scan_q32(quant->q32 + rows[i] * NUM_LETTERS, draws[i]);
+            mismatches += got != expect[i];
+        }
+
+        if (k == 0)
+            scalar_ns = ns;
+        char name[16];
+        snprintf(name, sizeof(name), quant ? "%s/q%d" : "%s", kernels[k].name, quant ? quant->bits : 0);
+        if (quant && quant->bits == 16)
+            printf("%-24s %-10s %7.2f ns/scan %6.2fx %.4f%% differ\n", filename, name, ns, scalar_ns / ns,
+                   100.0 * mismatches / PROBES);
+        else
+            printf("%-24s %-10s %7.2f ns/scan %6.2fx %s\n", filename, name, ns, scalar_ns / ns,
+                   mismatches ? "MISMATCH" : "ok");
+    }
+    free(rows); free(draws); free(expect); free(nonempty);
+}
+
+// Phase timings in seconds (negative for phases that did not run) and the
+// generator counters, for --stats
+struct runstats {
+    double load, fix, prune, build, generate;
+    struct genstats gen;
+};
+
+void print_stats(const struct runstats *rs) {
+    const struct { const char *name; double t; } phases[] = {
+        { "load_ms", rs->load }, { "fix_ms", rs->fix }, { "prune_ms", rs->prune }, { "build_ms", rs->build },
+    };
+    fprintf(stderr, "{");
+    const char *sep = "";
+    for (size_t i = 0; i < sizeof(phases) / sizeof(phases[0]); i++) {
+        if (phases[i].t >= 0.0) {
+            fprintf(stderr, "%s\"%s\": %.3f", sep, phases[i].name, phases[i].t * 1e3);
+            sep = ", ";
+        }
+    }
+    if (rs->generate >= 0.0) {
+        const struct genstats *g = &rs->gen;
+        fprintf(stderr, "%s\"generate\": {\"ms\": %.3f, \"names\": %llu, \"names_per_sec\": %.0f, "
+                "\"draws\": %llu, \"restarts\": %llu, \"backtracks\": %llu, \"aborts\": %llu, \"lengths\": {",
+                sep, rs->generate * 1e3, (unsigned long long)g->names, rs->generate > 0.0 ? g->names / rs->generate : 0.0,
+                (unsigned long long)g->draws, (unsigned long long)g->restarts,
+                (unsigned long long)g->backtracks, (unsigned long long)g->aborts);
+        const char *lsep = "";
+        for (int i = 0; i < 256; i++) {
+            if (g->lengths[i]) {
+                fprintf(stderr, "%s\"%d\": %llu", lsep, i, (unsigned long long)g->lengths[i]);
+                lsep = ", ";
+            }
+        }
+        fprintf(stderr, "}}");
     }
+    fprintf(stderr, "}\n");
+    fflush(stderr);
 }
 
 int main(int argc, char *argv[]) {
-    struct ltrfile ltr;
+    struct ltrmodel model;
     parse_cmdline(argc, argv);
+    select_kernel(cfg.kernel);
 
-    srand(cfg.seed ? cfg.seed : time(NULL));
+    if (cfg.bench) {
+        for (int i = 0; i < cfg.num_files; i++) {
+            open_model(cfg.files[i], &model);
+            if (!(cfg.nofix))
+                fix_ltr(model.ltr);
+            if (cfg.quantize)
+                model.quant = build_quant(&model.ltr->data, model.ltr->header.num_letters, cfg.quantize);
+            bench_kernels(cfg.files[i], model.ltr, model.quant);
+            close_model(&model);
+        }
+        return 0;
+    }
 
-    if (cfg.build)
-        build_ltr(cfg.ltrfile, &ltr);
-    else
-        load_ltr(cfg.ltrfile, &ltr);
+    if (cfg.pack) {
+        pack_ltrs(cfg.files, cfg.num_files, cfg.output, cfg.format ? cfg.format : 2, cfg.nofix);
+        return 0;
+    }
 
-    if (!(cfg.nofix))
-        fix_ltr(&ltr);
+    if (cfg.classify) {
+        classify_names(cfg.files, cfg.num_files, cfg.top, cfg.threads, cfg.nofix, cfg.smooth, cfg.smooth_k);
+        return 0;
+    }
+
+    struct runstats rs = { -1.0, -1.0, -1.0, -1.0, -1.0, {0} };
+    double t = now();
+    if (cfg.tagged) {
+        build_tagged(cfg.ltrfile, cfg.alphabet ? cfg.alphabet : letters, cfg.files, cfg.num_files - 1, cfg.threads,
+                     cfg.format ? cfg.format : 1, cfg.smooth, cfg.smooth_k);
+        rs.build = now() - t;
+        if (cfg.stats)
+            print_stats(&rs);
+        return 0;
+    }
+    if (cfg.build) {
+        build_ltr(&model, cfg.alphabet ? cfg.alphabet : letters, cfg.files, cfg.num_files - 1, cfg.threads);
+        if (cfg.smooth)
+            smooth_ltr(&model, cfg.smooth, cfg.smooth_k);
+        write_ltr(cfg.ltrfile, &model, cfg.format ? cfg.format : 1);
+        rs.build = now() - t;
+    } else if (cfg.blend) {
+        blend_ltr(&model, cfg.files, cfg.num_files, cfg.nofix);
+        rs.build = now() - t;
+    } else if (cfg.update) {
+        open_model(cfg.ltrfile, &model);
+        open_counts(cfg.ltrfile, &model, 1);
+        // add_names() rebuilds the CDFs from the counts alone
+        if (model.smoothed && !cfg.smooth)
+            die("%s was smoothed, which -u would undo. Give --smooth again", cfg.ltrfile);
+        add_names(&model, cfg.files, cfg.num_files - 1, cfg.threads);
+        if (cfg.smooth)
+            smooth_ltr(&model, cfg.smooth, cfg.smooth_k);
+        write_ltr(cfg.ltrfile, &model, cfg.format ? cfg.format : model.format);
+        rs.build = now() - t;
+    } else {
+        open_model(cfg.ltrfile, &model);
+        // The counts of a V1.0 file, for -o to carry over and --smooth=addk
+        if (cfg.output || cfg.smooth)
+            open_counts(cfg.ltrfile, &model, 0);
+        rs.load = now() - t;
+    }
+
+    if (!(cfg.nofix || cfg.blend)) {
+        t = now();
+        fix_ltr(model.ltr);
+        rs.fix = now() - t;
+    }
+
+    if (cfg.smooth && !(cfg.build || cfg.update))
+        smooth_ltr(&model, cfg.smooth, cfg.smooth_k);
+
+    model.force_end |= cfg.force_end;
+    if (cfg.prune) {
+        t = now();
+        prune_ltr(&model);
+        rs.prune = now() - t;
+    }
+
+    if (cfg.output)
+        write_ltr(cfg.output, &model, cfg.format ? cfg.format : 1);
+    if (cfg.emit_header)
+        emit_header(cfg.emit_header, cfg.ltrfile, &model);
+
+    if (cfg.alias && cfg.generate)
+        model.alias = build_alias(&model.ltr->data, model.ltr->header.num_letters);
+    if (cfg.sparse)
+        model.sparse = build_sparse(&model.ltr->data, model.ltr->header.num_letters);
+    if (cfg.quantize)
+        model.quant = build_quant(&model.ltr->data, model.ltr->header.num_letters, cfg.quantize);
+    if (cfg.relayout)
+        model.layout = build_layout(&model);
+    if (cfg.generate && (cfg.min_len || cfg.max_len || cfg.prefix || cfg.suffix))
+        model.constraint = new_constraint(&model, cfg.min_len, cfg.max_len, cfg.prefix, cfg.suffix);
 
     if (cfg.print)
-        print_ltr(&ltr);
+        print_ltr(&model);
+
+    if (cfg.enumerate > 0)
+        enumerate_names(&model, cfg.enumerate, (size_t)cfg.enum_mem << 20);
+
+    if (cfg.score)
+        score_names(&model, cfg.files, cfg.num_files - 1, cfg.threads);
+
+    if (cfg.generate) {
+        t = now();
+        generate_names(&model, cfg.seed ? cfg.seed : time(NULL), cfg.counter, cfg.index, cfg.generate, cfg.threads,
+                       model.constraint ? 0 : cfg.lanes, cfg.stats ? &rs.gen : NULL);
+        rs.generate = now() - t;
+    }
+
+    if (cfg.stats)
+        print_stats(&rs);
 
-    while (cfg.generate-- > 0)
-        printf("%s\n", random_name(&ltr));
+    free_constraint(model.constraint);
+    close_model(&model);
 
     return 0;
 }